@@ -3,39 +3,55 @@ TARGET = ashlar
 QT += widgets svg webkitwidgets network xml core
 requires(qtConfig(filedialog))
 
-HEADERS         = src/commands.h \
+HEADERS         = src/blockstore.h \
+                  src/brackets.h \
+                  src/commands.h \
                   src/editor.h \
                   src/extension.h \
+                  src/frameprobe.h \
+                  src/grammarprofile.h \
                   src/gutter.h \
                   src/highlighter.h \
                   src/icons.h \
                   src/js.h \
+                  src/jsoncache.h \
                   src/mainwindow.h \
                   src/minimap.h \
                   src/sidebar.h \
                   src/settings.h \
                   src/select.h \
+                  src/styles.h \
                   src/tabs.h \
                   src/tmedit.h \
+                  src/tokencache.h \
+                  src/tokenizer.h \
                   src/process.h \
                   ./js-qt-native/qt/core.h \
                   ./js-qt-native/qt/engine.h \
                   ./easing/PennerEasing/Cubic.h
 
-SOURCES         = src/commands.cpp \
+SOURCES         = src/blockstore.cpp \
+                  src/brackets.cpp \
+                  src/commands.cpp \
                   src/editor.cpp \
                   src/extension.cpp \
+                  src/frameprobe.cpp \
+                  src/grammarprofile.cpp \
                   src/gutter.cpp \
                   src/highlighter.cpp \
                   src/icons.cpp \
                   src/js.cpp \
+                  src/jsoncache.cpp \
                   src/mainwindow.cpp \
                   src/minimap.cpp \
                   src/sidebar.cpp \
                   src/select.cpp \
                   src/settings.cpp \
+                  src/styles.cpp \
                   src/tabs.cpp \
                   src/tmedit.cpp \
+                  src/tokencache.cpp \
+                  src/tokenizer.cpp \
                   src/process.cpp \
                   src/main.cpp \
                   ./js-qt-native/qt/core.cpp \
@@ -0,0 +1,44 @@
+TARGET = ashlar-bench
+
+QT += core gui
+QT -= widgets
+CONFIG += console c++17
+CONFIG -= app_bundle
+
+HEADERS         = ../src/brackets.h \
+                  ../src/extension.h \
+                  ../src/grammarprofile.h \
+                  ../src/jsoncache.h \
+                  ../src/styles.h \
+                  ../src/tokenizer.h
+
+SOURCES         = main.cpp \
+                  ../src/brackets.cpp \
+                  ../src/extension.cpp \
+                  ../src/grammarprofile.cpp \
+                  ../src/jsoncache.cpp \
+                  ../src/styles.cpp \
+                  ../src/tokenizer.cpp \
+                  ../tm-parser/textmate/parser/grammar.cpp \
+                  ../tm-parser/textmate/parser/reader.cpp \
+                  ../tm-parser/textmate/parser/pattern.cpp \
+                  ../tm-parser/textmate/parser/parser.cpp \
+                  ../tm-parser/textmate/scopes/scope.cpp \
+                  ../tm-parser/textmate/scopes/types.cpp \
+                  ../tm-parser/textmate/scopes/parse.cpp \
+                  ../tm-parser/textmate/scopes/match.cpp \
+                  ../tm-parser/textmate/theme/theme.cpp \
+                  ../tm-parser/textmate/theme/util.cpp
+
+QMAKE_CXXFLAGS += -fpermissive
+
+INCPATH +=  ../src
+INCPATH +=  ../tm-parser/textmate/parser
+INCPATH +=  ../tm-parser/textmate/scopes
+INCPATH +=  ../tm-parser/textmate/theme
+
+INCPATH += /usr/json/include 
+LIBS += /usr/lib/libjsoncpp.so
+
+INCPATH += /usr/include
+LIBS += /usr/lib/libonigmo.so
@@ -0,0 +1,238 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+
+#include <sys/resource.h>
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+#include "extension.h"
+#include "parse.h"
+#include "reader.h"
+
+// lines longer than this are skipped so that a few minified lines do not
+// dominate the figures. the editor parses them whole, off the gui thread
+#define BENCH_LONG_LINE 2048
+
+struct grammar_stats_t {
+    int files;
+    size_t lines;
+    size_t bytes;
+    size_t tokens;
+    qint64 nsecs;
+    long peakGrowth; // kB the process peak rss rose by while tokenizing
+};
+
+static long peak_rss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void collect_files(const QString& path, QStringList& files)
+{
+    QFileInfo info(path);
+    if (info.isFile()) {
+        files << info.absoluteFilePath();
+        return;
+    }
+
+    QDirIterator it(path, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        files << it.next();
+    }
+}
+
+static void tokenize_file(const QString& path, language_info_ptr lang, grammar_stats_t& stats)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly | QFile::Text)) {
+        return;
+    }
+
+    std::vector<std::string> lines;
+    while (!file.atEnd()) {
+        std::string line = file.readLine().toStdString();
+        if (line.empty() || line.back() != '\n') {
+            line += "\n";
+        }
+        lines.emplace_back(std::move(line));
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    parse::stack_ptr parser_state = lang->grammar->seed();
+    bool firstLine = true;
+    for (auto& str : lines) {
+        if (str.length() > BENCH_LONG_LINE) {
+            continue;
+        }
+
+        const char* first = str.c_str();
+        const char* last = first + str.length();
+
+        std::map<size_t, scope::scope_t> scopes;
+        parser_state = parse::parse(first, last, parser_state, scopes, firstLine);
+        firstLine = false;
+
+        stats.tokens += scopes.size() + 1;
+        stats.bytes += str.length();
+        stats.lines++;
+    }
+
+    stats.nsecs += timer.nsecsElapsed();
+    stats.files++;
+}
+
+static double lines_per_sec(grammar_stats_t& stats)
+{
+    return stats.nsecs ? stats.lines * 1e9 / stats.nsecs : 0;
+}
+
+static double bytes_per_sec(grammar_stats_t& stats)
+{
+    return stats.nsecs ? stats.bytes * 1e9 / stats.nsecs : 0;
+}
+
+static double tokens_per_line(grammar_stats_t& stats)
+{
+    return stats.lines ? (double)stats.tokens / stats.lines : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("tokenizes a corpus and reports throughput per grammar");
+    QCommandLineOption extensionsOption({ "e", "extensions" }, "extensions path (repeatable)", "path");
+    QCommandLineOption repeatOption({ "r", "repeat" }, "passes over the corpus, the fastest is kept", "count", "3");
+    QCommandLineOption saveOption({ "s", "save" }, "write results as a baseline", "file");
+    QCommandLineOption baselineOption({ "b", "baseline" }, "compare against a saved baseline", "file");
+    QCommandLineOption toleranceOption({ "t", "tolerance" }, "allowed lines/sec drop against the baseline (percent)", "percent", "10");
+    parser.addPositionalArgument("files", "files or directories to tokenize");
+    parser.addHelpOption();
+    parser.addOption(extensionsOption);
+    parser.addOption(repeatOption);
+    parser.addOption(saveOption);
+    parser.addOption(baselineOption);
+    parser.addOption(toleranceOption);
+    parser.process(app);
+
+    std::vector<Extension> extensions;
+    QStringList extensionPaths = parser.values(extensionsOption);
+    if (extensionPaths.isEmpty()) {
+        extensionPaths << QStandardPaths::locate(QStandardPaths::HomeLocation, ".ashlar/extensions", QStandardPaths::LocateDirectory);
+        extensionPaths << "./extensions";
+    }
+    for (auto path : extensionPaths) {
+        if (!path.isEmpty()) {
+            load_extensions(path, extensions);
+        }
+    }
+
+    QStringList files;
+    for (auto path : parser.positionalArguments()) {
+        collect_files(path, files);
+    }
+    if (files.isEmpty()) {
+        parser.showHelp(1);
+    }
+
+    // grammars are compiled up front so that the passes measure tokenizing only
+    std::map<std::string, std::vector<std::pair<QString, language_info_ptr>>> corpus;
+    for (auto path : files) {
+        language_info_ptr lang = language_from_file(path, extensions);
+        if (!lang || !lang->grammar || lang->grammarPath.empty()) {
+            continue;
+        }
+        corpus[lang->id].push_back({ path, lang });
+    }
+
+    int repeat = std::max(1, parser.value(repeatOption).toInt());
+
+    // ru_maxrss is a process wide high water mark. a grammar is charged for
+    // how far its passes pushed it, one that fits in memory already peaked
+    // by an earlier grammar reports 0. run the bench on a single grammar's
+    // files for its own peak
+    std::map<std::string, grammar_stats_t> results;
+    for (auto& g : corpus) {
+        long peakBefore = peak_rss();
+        grammar_stats_t best = {};
+        for (int i = 0; i < repeat; i++) {
+            grammar_stats_t stats = {};
+            for (auto& f : g.second) {
+                tokenize_file(f.first, f.second, stats);
+            }
+            if (i == 0 || stats.nsecs < best.nsecs) {
+                best = stats;
+            }
+        }
+        best.peakGrowth = peak_rss() - peakBefore;
+        results[g.first] = best;
+    }
+
+    printf("%-20s %6s %10s %12s %12s %10s %10s %10s\n", "grammar", "files", "lines", "lines/s", "MB/s", "tok/line", "ms", "peak +MB");
+    for (auto& r : results) {
+        grammar_stats_t& s = r.second;
+        printf("%-20s %6d %10zu %12.0f %12.2f %10.2f %10.1f %10.1f\n",
+            r.first.c_str(), s.files, s.lines,
+            lines_per_sec(s), bytes_per_sec(s) / (1024 * 1024),
+            tokens_per_line(s), s.nsecs / 1e6, s.peakGrowth / 1024.0);
+    }
+    printf("process peak rss %.1f MB\n", peak_rss() / 1024.0);
+
+    if (parser.isSet(saveOption)) {
+        Json::Value root;
+        for (auto& r : results) {
+            Json::Value g;
+            g["lines_per_sec"] = lines_per_sec(r.second);
+            g["bytes_per_sec"] = bytes_per_sec(r.second);
+            g["tokens_per_line"] = tokens_per_line(r.second);
+            g["lines"] = (Json::UInt64)r.second.lines;
+            root[r.first] = g;
+        }
+        Json::StreamWriterBuilder builder;
+        std::ofstream out(parser.value(saveOption).toStdString());
+        out << Json::writeString(builder, root) << std::endl;
+    }
+
+    int regressions = 0;
+    if (parser.isSet(baselineOption)) {
+        Json::Value baseline = parse::loadJson(parser.value(baselineOption).toStdString());
+        double tolerance = parser.value(toleranceOption).toDouble() / 100;
+
+        printf("\n%-20s %12s %12s %8s\n", "grammar", "baseline", "now", "change");
+        for (auto& r : results) {
+            if (!baseline.isMember(r.first)) {
+                continue;
+            }
+            Json::Value& g = baseline[r.first];
+            double before = g["lines_per_sec"].asDouble();
+            double now = lines_per_sec(r.second);
+            double change = before > 0 ? (now - before) / before : 0;
+            bool regressed = change < -tolerance;
+
+            // a different token count means the grammar (or the parser) changed output
+            bool changed = g.isMember("tokens_per_line") && fabs(g["tokens_per_line"].asDouble() - tokens_per_line(r.second)) > 0.005;
+
+            printf("%-20s %12.0f %12.0f %7.1f%%%s%s\n", r.first.c_str(), before, now, change * 100,
+                regressed ? "  REGRESSION" : "",
+                changed ? "  tokens/line changed" : "");
+            if (regressed) {
+                regressions++;
+            }
+        }
+    }
+
+    return regressions ? 1 : 0;
+}
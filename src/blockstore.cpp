@@ -0,0 +1,146 @@
+#include <algorithm>
+
+#include "blockstore.h"
+
+// smallest run handed out, most lines have a few tokens
+#define BLOCK_STORE_MIN_RUN 4
+
+token_t token_view_t::operator[](size_t i) const
+{
+    return store->token(range.offset + i);
+}
+
+bracket_info_t bracket_view_t::operator[](size_t i) const
+{
+    return store->bracket(range.offset + i, line);
+}
+
+static int run_class(uint32_t capacity)
+{
+    int c = 0;
+    while ((1u << c) < capacity) {
+        c++;
+    }
+    return c;
+}
+
+// returns true if the run moved (or grew) and the arrays need resizing
+bool BlockStore::arena_t::reserve(block_range_t& range, uint32_t count)
+{
+    range.count = count;
+    if (count <= range.capacity) {
+        return false;
+    }
+
+    release(range);
+    range.count = count;
+
+    uint32_t capacity = BLOCK_STORE_MIN_RUN;
+    while (capacity < count) {
+        capacity <<= 1;
+    }
+    range.capacity = capacity;
+
+    std::vector<uint32_t>& list = free[run_class(capacity)];
+    if (list.size()) {
+        range.offset = list.back();
+        list.pop_back();
+        return false;
+    }
+
+    range.offset = size;
+    size += capacity;
+    return true;
+}
+
+void BlockStore::arena_t::release(block_range_t& range)
+{
+    if (range.capacity) {
+        free[run_class(range.capacity)].push_back(range.offset);
+    }
+    range.offset = 0;
+    range.count = 0;
+    range.capacity = 0;
+}
+
+BlockStore::BlockStore()
+{
+    tokenArena.size = 0;
+    bracketArena.size = 0;
+}
+
+void BlockStore::setTokens(block_range_t& range, std::vector<token_t>& tokens)
+{
+    if (tokenArena.reserve(range, tokens.size()) && tokenArena.size > tokenScopes.size()) {
+        size_t size = std::max((size_t)tokenArena.size, tokenScopes.size() * 2);
+        tokenStarts.resize(size);
+        tokenLengths.resize(size);
+        tokenScopes.resize(size);
+    }
+
+    uint32_t o = range.offset;
+    for (auto& token : tokens) {
+        tokenStarts[o] = token.start;
+        tokenLengths[o] = token.length;
+        tokenScopes[o] = token.scope;
+        o++;
+    }
+}
+
+bool BlockStore::sameTokens(block_range_t& range, std::vector<token_t>& tokens)
+{
+    if (range.count != tokens.size()) {
+        return false;
+    }
+
+    uint32_t o = range.offset;
+    for (auto& token : tokens) {
+        if (tokenStarts[o] != token.start || tokenLengths[o] != token.length || tokenScopes[o] != token.scope) {
+            return false;
+        }
+        o++;
+    }
+    return true;
+}
+
+void BlockStore::setBrackets(block_range_t& range, std::vector<bracket_info_t>& brackets)
+{
+    if (bracketArena.reserve(range, brackets.size()) && bracketArena.size > bracketIds.size()) {
+        size_t size = std::max((size_t)bracketArena.size, bracketIds.size() * 2);
+        bracketPositions.resize(size);
+        bracketIds.resize(size);
+        bracketOpen.resize(size);
+    }
+
+    uint32_t o = range.offset;
+    for (auto& b : brackets) {
+        bracketPositions[o] = b.position;
+        bracketIds[o] = b.bracket;
+        bracketOpen[o] = b.open;
+        o++;
+    }
+}
+
+void BlockStore::releaseTokens(block_range_t& range)
+{
+    tokenArena.release(range);
+}
+
+void BlockStore::releaseBrackets(block_range_t& range)
+{
+    bracketArena.release(range);
+}
+
+token_t BlockStore::token(uint32_t index)
+{
+    return { .start = tokenStarts[index], .length = tokenLengths[index], .scope = tokenScopes[index] };
+}
+
+bracket_info_t BlockStore::bracket(uint32_t index, int line)
+{
+    return { .line = (size_t)line,
+        .position = bracketPositions[index],
+        .bracket = bracketIds[index],
+        .open = (bool)bracketOpen[index],
+        .unpaired = false };
+}
@@ -0,0 +1,132 @@
+#ifndef BLOCKSTORE_H
+#define BLOCKSTORE_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "tokenizer.h"
+
+struct bracket_info_t {
+    size_t line;
+    size_t position;
+    int bracket;
+    bool open;
+    bool unpaired;
+};
+
+// a run of entries in one of the store's arrays, owned by a single block
+struct block_range_t {
+    uint32_t offset;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+class BlockStore;
+
+// read only views into the store, handing out entries by value
+template <typename View, typename T>
+struct block_view_iterator_t {
+    const View* view;
+    size_t index;
+
+    T operator*() const { return (*view)[index]; }
+    block_view_iterator_t& operator++()
+    {
+        index++;
+        return *this;
+    }
+    bool operator!=(const block_view_iterator_t& other) const { return index != other.index; }
+};
+
+class token_view_t {
+public:
+    typedef block_view_iterator_t<token_view_t, token_t> iterator;
+
+    token_view_t(BlockStore* store, block_range_t range)
+        : store(store)
+        , range(range)
+    {
+    }
+
+    size_t size() const { return range.count; }
+    bool empty() const { return !range.count; }
+    token_t operator[](size_t i) const;
+
+    iterator begin() const { return { this, 0 }; }
+    iterator end() const { return { this, size() }; }
+
+private:
+    BlockStore* store;
+    block_range_t range;
+};
+
+class bracket_view_t {
+public:
+    typedef block_view_iterator_t<bracket_view_t, bracket_info_t> iterator;
+
+    bracket_view_t(BlockStore* store, block_range_t range, int line)
+        : store(store)
+        , range(range)
+        , line(line)
+    {
+    }
+
+    size_t size() const { return range.count; }
+    bool empty() const { return !range.count; }
+    bracket_info_t operator[](size_t i) const;
+    bracket_info_t back() const { return (*this)[size() - 1]; }
+
+    iterator begin() const { return { this, 0 }; }
+    iterator end() const { return { this, size() }; }
+
+private:
+    BlockStore* store;
+    block_range_t range;
+    int line;
+};
+
+//----------------------
+// block store
+//----------------------
+// tokens and brackets of every block in a document, kept as parallel
+// arrays. blocks own power of two sized runs which are rewritten in place
+// when they fit and recycled through free lists when they do not, so
+// rehighlighting does not allocate per line
+class BlockStore {
+public:
+    BlockStore();
+
+    void setTokens(block_range_t& range, std::vector<token_t>& tokens);
+    bool sameTokens(block_range_t& range, std::vector<token_t>& tokens);
+    void setBrackets(block_range_t& range, std::vector<bracket_info_t>& brackets);
+    void releaseTokens(block_range_t& range);
+    void releaseBrackets(block_range_t& range);
+
+    token_t token(uint32_t index);
+    bracket_info_t bracket(uint32_t index, int line);
+
+private:
+    struct arena_t {
+        uint32_t size;
+        std::vector<uint32_t> free[32];
+
+        bool reserve(block_range_t& range, uint32_t count);
+        void release(block_range_t& range);
+    };
+
+    arena_t tokenArena;
+    std::vector<uint32_t> tokenStarts;
+    std::vector<uint32_t> tokenLengths;
+    std::vector<int32_t> tokenScopes;
+
+    arena_t bracketArena;
+    std::vector<uint32_t> bracketPositions;
+    std::vector<int16_t> bracketIds;
+    std::vector<uint8_t> bracketOpen;
+};
+
+// shared with the block data, which the document may free after the highlighter
+typedef std::shared_ptr<BlockStore> block_store_ptr;
+
+#endif // BLOCKSTORE_H
@@ -0,0 +1,101 @@
+#include <QString>
+
+#include <algorithm>
+
+#include "brackets.h"
+
+bracket_matcher_t::bracket_matcher_t()
+    : nodes(1)
+    , count(0)
+{
+    nodes[0].match = -1;
+    std::fill(first, first + 256, 0);
+}
+
+int bracket_matcher_t::child(int node, ushort c)
+{
+    if (node == 0 && c < 256) {
+        return first[c];
+    }
+    for (auto& n : nodes[node].next) {
+        if (n.first == c) {
+            return n.second;
+        }
+    }
+    return 0;
+}
+
+int bracket_matcher_t::insert(int node, ushort c)
+{
+    int next = child(node, c);
+    if (next) {
+        return next;
+    }
+
+    next = nodes.size();
+    nodes.push_back({ .next = {}, .match = -1 });
+    if (node == 0 && c < 256) {
+        first[c] = next;
+    } else {
+        nodes[node].next.push_back({ c, next });
+    }
+    return next;
+}
+
+void bracket_matcher_t::build(std::vector<std::string>& open, std::vector<std::string>& close)
+{
+    // pattern i is open[i], pattern open.size() + i is close[i]
+    count = open.size();
+    for (int i = 0; i < open.size() + close.size(); i++) {
+        std::string& b = i < count ? open[i] : close[i - count];
+        QString s = QString::fromStdString(b);
+        if (s.isEmpty()) {
+            continue;
+        }
+
+        int node = 0;
+        for (QChar c : s) {
+            node = insert(node, c.unicode());
+        }
+        if (nodes[node].match == -1) {
+            nodes[node].match = i;
+        }
+    }
+}
+
+void bracket_matcher_t::scan(const QChar* line, size_t start, size_t end, std::vector<bracket_match_t>& matches)
+{
+    size_t i = start;
+    while (i < end) {
+        int node = child(0, line[i].unicode());
+        if (!node) {
+            i++;
+            continue;
+        }
+
+        int best = -1;
+        size_t length = 0;
+        size_t j = i;
+        while (node) {
+            int match = nodes[node].match;
+            if (match != -1 && (best == -1 || match < best)) {
+                best = match;
+                length = j - i + 1;
+            }
+            if (++j >= end) {
+                break;
+            }
+            node = child(node, line[j].unicode());
+        }
+
+        if (best == -1) {
+            i++;
+            continue;
+        }
+
+        matches.push_back({ .position = i,
+            .bracket = best < count ? best : best - count,
+            .open = best < count });
+        i += length;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef BRACKETS_H
+#define BRACKETS_H
+
+#include <QChar>
+
+#include <string>
+#include <vector>
+
+struct bracket_match_t {
+    size_t position;
+    int bracket;
+    bool open;
+};
+
+//----------------------
+// bracket matcher
+//----------------------
+// compiled once per language. candidate positions are picked out by a
+// first character table and confirmed by walking a trie of all brackets,
+// so a line is scanned once no matter how many brackets the language has.
+// as before, a position takes the first listed bracket that matches there
+// (openers before closers)
+struct bracket_matcher_t {
+    bracket_matcher_t();
+
+    void build(std::vector<std::string>& open, std::vector<std::string>& close);
+    void scan(const QChar* line, size_t start, size_t end, std::vector<bracket_match_t>& matches);
+
+private:
+    struct node_t {
+        std::vector<std::pair<ushort, int>> next;
+        int match;
+    };
+
+    int child(int node, ushort c);
+    int insert(int node, ushort c);
+
+    std::vector<node_t> nodes;
+    int first[256];
+    int count;
+};
+
+#endif // BRACKETS_H
@@ -322,8 +322,8 @@ static void autoIndentForCursor(Editor const* editor, QTextCursor cursor)
 
     if (block.isValid()) {
         blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
-        if (blockData->brackets.size()) {
-            beginsWithCloseBracket = !blockData->brackets[0].open;
+        if (blockData->brackets().size()) {
+            beginsWithCloseBracket = !blockData->brackets()[0].open;
         }
     }
 
@@ -355,8 +355,8 @@ static void autoIndentForCursor(Editor const* editor, QTextCursor cursor)
     }
 
     blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
-    if (blockData && blockData->brackets.size()) {
-        auto b = blockData->brackets.back();
+    if (blockData && blockData->brackets().size()) {
+        auto b = blockData->brackets().back();
         if (b.open) {
             if (settings->tab_to_spaces) {
                 white_spaces += settings->tab_size;
@@ -4,6 +4,7 @@
 
 #include "commands.h"
 #include "editor.h"
+#include "frameprobe.h"
 #include "gutter.h"
 #include "mainwindow.h"
 #include "minimap.h"
@@ -21,9 +22,9 @@ Editor::Editor(QWidget* parent)
     , highlighter(0)
     , editor(0)
     , savingTimer(this)
-    , updateTimer(this)
     , dirty(false)
     , preview(true)
+    , renderGeneration(0)
 {
     savingTimer.setSingleShot(true);
     connect(&watcher, SIGNAL(fileChanged(const QString&)), this, SLOT(fileChanged(const QString&)));
@@ -51,6 +52,7 @@ bool Editor::saveFile(const QString& path)
         watcher.removePaths(watcher.files());
         watcher.addPath(fileName);
         dirty = false;
+        highlighter->setCacheFile(fileName);
         return true;
     }
     return false;
@@ -70,18 +72,17 @@ bool Editor::openFile(const QString& path)
         dirty = false;
 
         if (file.size() > (1024 * 16)) {
-            // todo do super load!
-            if (file.size() > (1024 * 256)) {
-                std::cout << "do threaded syntax highlighting at load" << std::endl;
-            }
-
+            // syntax highlighting is streamed in by the tokenizer thread
             std::cout << file.size() << std::endl;
             highlighter->setDeferRendering(true);
             editor->setPlainText(file.readAll());
+            highlighter->setCacheFile(fileName);
+            highlighter->restoreTokens();
             highlightBlocks();
         } else {
             highlighter->setDeferRendering(false);
             editor->setPlainText(file.readAll());
+            highlighter->setCacheFile(fileName);
         }
 
         return true;
@@ -91,14 +92,8 @@ bool Editor::openFile(const QString& path)
 
 void Editor::invalidateBuffers()
 {
-    QTextBlock block = editor->document()->begin();
-    while (block.isValid()) {
-        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
-        if (blockData) {
-            blockData->buffer = QPixmap();
-        }
-        block = block.next();
-    }
+    // stale pixmaps are left for the cache to evict
+    renderGeneration++;
 }
 
 bool Editor::isPreview()
@@ -206,8 +201,9 @@ void Editor::setTheme(theme_ptr _theme)
     }
 
     if (highlighter) {
-        highlighter->rehighlight();
+        highlighter->restyle();
     }
+    invalidateBuffers();
 
     updateGutter(true);
     updateMiniMap(true);
@@ -286,6 +282,8 @@ void Editor::setupEditor()
     highlighter = new Highlighter(editor->document());
     highlighter->setTheme(theme);
 
+    connect(highlighter, SIGNAL(highlightProgress()), this, SLOT(highlightProgress()));
+
     updateMiniMap();
 }
 
@@ -373,6 +371,8 @@ static bool isFoldable(QTextBlock& block)
 
 void Editor::updateGutter(bool force)
 {
+    FrameProbe probe(PROBE_GUTTER);
+
     if (!gutter) {
         return;
     }
@@ -395,11 +395,13 @@ void Editor::updateGutter(bool force)
     QRectF sidebarRect(0, 0, sw, height());
 
     QTextBlock block = editor->_firstVisibleBlock();
+    int firstVisible = block.blockNumber();
     if (block.previous().isValid()) {
         block = block.previous();
     }
 
     int index = 0;
+    int lastVisible = firstVisible;
     while (block.isValid()) {
         if (block.isVisible()) {
             QRectF rect = editor->_blockBoundingGeometry(block).translated(editor->_contentOffset());
@@ -411,43 +413,51 @@ void Editor::updateGutter(bool force)
             gutter->lineNumbers[index].foldable = isFoldable(block);
             ++index;
             // }
+            lastVisible = block.blockNumber();
             if (rect.top() > sidebarRect.bottom() + 40)
                 break;
         }
         block = block.next();
     }
     gutter->lineNumbers.resize(index);
+
+    if (highlighter) {
+        highlighter->setVisibleRange(firstVisible, lastVisible);
+    }
     gutter->update();
     updateScrollBar();
 }
 
 void Editor::highlightBlocks()
 {
-    int rendered = 0;
+    highlighter->scheduleHighlight();
+}
 
-    if (!updateIterator.isValid()) {
-        QTextDocument* doc = editor->document();
-        updateIterator = doc->begin();
-    }
+void Editor::showEvent(QShowEvent* event)
+{
+    QWidget::showEvent(event);
+    highlighter->setForeground(true);
+    highlighter->scheduleHighlight();
 
-    while (updateIterator.isValid() && rendered < 200) {
-        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(updateIterator.userData());
-        if (!blockData) {
-            rendered++;
-            blockData = new HighlightBlockData;
-            updateIterator.setUserData(blockData);
-            highlighter->rehighlightBlock(updateIterator);
-        }
-        updateIterator = updateIterator.next();
-    }
+    // progress made while hidden was not painted
+    editor->paintToBuffer();
+    mini->buffer = QPixmap();
+    mini->update();
+}
 
-    if (rendered > 0) {
-        updateTimer.singleShot(50, this, SLOT(highlightBlocks()));
-    } else {
-        std::cout << "all rendering done" << std::endl;
-        highlighter->setDeferRendering(false);
-    }
+void Editor::hideEvent(QHideEvent* event)
+{
+    QWidget::hideEvent(event);
+    // hidden tabs keep tokenizing, within the background cpu share
+    highlighter->setForeground(false);
+}
 
+void Editor::highlightProgress()
+{
+    // hidden tabs are painted once shown
+    if (!isVisible()) {
+        return;
+    }
     editor->paintToBuffer();
     mini->buffer = QPixmap();
     mini->update();
@@ -470,7 +480,7 @@ bracket_info_t Editor::bracketAtCursor(QTextCursor cursor)
     }
 
     size_t p = cursor.position() - block.position();
-    for (auto bracket : blockData->brackets) {
+    for (auto bracket : blockData->brackets()) {
         if (bracket.position == p) {
             return bracket;
         }
@@ -511,7 +521,7 @@ QTextCursor Editor::findLastOpenBracketCursor(QTextBlock block)
     }
 
     QTextCursor res;
-    for (auto b : blockData->foldingBrackets) {
+    for (auto b : blockData->foldingBrackets()) {
         if (b.open) {
             if (res.isNull()) {
                 res = editor->textCursor();
@@ -538,7 +548,7 @@ QTextCursor Editor::findBracketMatchCursor(bracket_info_t bracket, QTextCursor c
                 break;
             }
 
-            for (auto b : blockData->brackets) {
+            for (auto b : blockData->brackets()) {
                 if (b.line == bracket.line && b.position < bracket.position) {
                     continue;
                 }
@@ -575,8 +585,9 @@ QTextCursor Editor::findBracketMatchCursor(bracket_info_t bracket, QTextCursor c
             }
 
             // for(auto b : blockData->brackets) {
-            for (auto it = blockData->brackets.rbegin(); it != blockData->brackets.rend(); ++it) {
-                bracket_info_t b = *it;
+            bracket_view_t blockBrackets = blockData->brackets();
+            for (size_t i = blockBrackets.size(); i-- > 0;) {
+                bracket_info_t b = blockBrackets[i];
                 if (b.line == bracket.line && b.position > bracket.position) {
                     continue;
                 }
@@ -672,19 +683,15 @@ QStringList Editor::scopesAtCursor(QTextCursor cursor)
     cursor.movePosition(QTextCursor::StartOfLine);
     pos -= cursor.position();
 
-    std::map<size_t, scope::scope_t> scopes = blockData->scopes;
-    std::map<size_t, scope::scope_t>::iterator it = scopes.begin();
-    scope::scope_t scope;
-    while (it != scopes.end()) {
-        size_t n = it->first;
-        if (n > pos) {
+    int scope = 0;
+    for (auto token : blockData->tokens()) {
+        if (token.start > pos) {
             break;
         }
-        scope = it->second;
-        it++;
+        scope = token.scope;
     }
 
-    std::string scopeName = to_s(scope);
+    std::string scopeName = scope_name(scope);
     res << QString(scopeName.c_str()).split(' ');
     return res;
 }
@@ -70,6 +70,9 @@ public:
     QColor backgroundColor;
     QColor selectionBgColor;
 
+    // rendered lines of an older generation are stale
+    int renderGeneration;
+
     editor_settings_ptr settings;
 
     theme_ptr theme;
@@ -81,11 +84,13 @@ public:
     QTextCursor findLastOpenBracketCursor(QTextBlock block);
     QTextCursor findBracketMatchCursor(bracket_info_t bracket, QTextCursor cursor);
 
+protected:
+    void showEvent(QShowEvent* event) override;
+    void hideEvent(QHideEvent* event) override;
+
 private:
     QTimer savingTimer;
-    QTimer updateTimer;
     QScrollBar* vscroll;
-    QTextBlock updateIterator;
     QFileSystemWatcher watcher;
 
     bool dirty;
@@ -101,6 +106,7 @@ private Q_SLOTS:
 
     void fileChanged(const QString& path);
     void cursorPositionChanged();
+    void highlightProgress();
 
 public slots:
     void highlightBlocks();
@@ -7,8 +7,10 @@
 #include <iostream>
 
 #include "extension.h"
+#include "jsoncache.h"
 #include "reader.h"
 #include "stringop.h"
+#include "tokenizer.h"
 
 #include "json/json.h"
 
@@ -138,6 +140,7 @@ static bool load_language_configuration(const QString path, language_info_ptr la
                 }
             }
             lang->brackets = lang->bracketOpen.size();
+            lang->bracketMatcher.build(lang->bracketOpen, lang->bracketClose);
         }
     }
 
@@ -166,6 +169,7 @@ language_info_ptr language_from_file(const QString path, std::vector<Extension>&
     qDebug() << path;
 
     static std::map<std::string, language_info_ptr> cache;
+    static std::map<std::string, parse::grammar_ptr> grammars;
     language_info_ptr lang = std::make_shared<language_info_t>();
 
     QFileInfo info(path);
@@ -265,7 +269,17 @@ language_info_ptr language_from_file(const QString path, std::vector<Extension>&
 
             if (foundGrammar) {
                 QString path = QDir(resolvedExtension.path).filePath(g["path"].asString().c_str());
-                lang->grammar = parse::parse_grammar(parse::loadJson(path.toStdString()));
+                // suffixes of one language (.h, .cpp..) share a compiled grammar
+                lang->grammarPath = path.toStdString();
+                auto git = grammars.find(lang->grammarPath);
+                if (git != grammars.end()) {
+                    lang->grammar = git->second;
+                } else {
+                    Json::Value json = load_json_cached(path);
+                    lang->grammar = parse::parse_grammar(json);
+                    register_grammar(lang->grammar, json);
+                    grammars.emplace(lang->grammarPath, lang->grammar);
+                }
                 lang->id = resolvedLanguage;
 
                 qDebug() << "grammar " << path.toStdString().c_str();
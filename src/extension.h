@@ -7,6 +7,7 @@
 #include <string>
 #include <vector>
 
+#include "brackets.h"
 #include "grammar.h"
 #include "json/json.h"
 #include "theme.h"
@@ -31,12 +32,14 @@ struct language_info_t {
     bool brackets;
     std::vector<std::string> bracketOpen;
     std::vector<std::string> bracketClose;
+    bracket_matcher_t bracketMatcher;
 
     bool pairs;
     std::vector<std::string> pairOpen;
     std::vector<std::string> pairClose;
 
     parse::grammar_ptr grammar;
+    std::string grammarPath;
 };
 
 struct icon_theme_t {
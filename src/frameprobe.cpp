@@ -0,0 +1,104 @@
+#include <algorithm>
+
+#include "frameprobe.h"
+
+static const char* probeNames[PROBE_COUNT] = {
+    "paint",
+    "highlight",
+    "gutter",
+    "minimap",
+    "overlay"
+};
+
+FrameProbes* FrameProbes::instance()
+{
+    static FrameProbes probes;
+    return &probes;
+}
+
+FrameProbes::FrameProbes()
+    : visible(false)
+{
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        samples[i].nsecs.resize(FRAME_PROBE_SAMPLES, 0);
+        samples[i].next = 0;
+        samples[i].count = 0;
+    }
+}
+
+void FrameProbes::record(int probe, qint64 nsecs)
+{
+    samples_t& s = samples[probe];
+    s.nsecs[s.next] = nsecs;
+    s.next = (s.next + 1) % FRAME_PROBE_SAMPLES;
+    if (s.count < FRAME_PROBE_SAMPLES) {
+        s.count++;
+    }
+}
+
+void FrameProbes::reset()
+{
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        samples[i].next = 0;
+        samples[i].count = 0;
+    }
+}
+
+probe_stats_t FrameProbes::stats(int probe)
+{
+    samples_t& s = samples[probe];
+    probe_stats_t res = {
+        .count = s.count,
+        .p50 = 0,
+        .p95 = 0,
+        .p99 = 0,
+        .max = 0
+    };
+    if (!s.count) {
+        return res;
+    }
+
+    std::vector<qint64> sorted(s.nsecs.begin(), s.nsecs.begin() + s.count);
+    std::sort(sorted.begin(), sorted.end());
+
+    auto percentile = [&sorted](int p) {
+        size_t i = std::min(sorted.size() - 1, sorted.size() * p / 100);
+        return sorted[i] / 1e6;
+    };
+
+    res.p50 = percentile(50);
+    res.p95 = percentile(95);
+    res.p99 = percentile(99);
+    res.max = sorted.back() / 1e6;
+    return res;
+}
+
+Json::Value FrameProbes::toJson()
+{
+    Json::Value root(Json::objectValue);
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        probe_stats_t s = stats(i);
+        Json::Value probe;
+        probe["count"] = s.count;
+        probe["p50"] = s.p50;
+        probe["p95"] = s.p95;
+        probe["p99"] = s.p99;
+        probe["max"] = s.max;
+        root[probeNames[i]] = probe;
+    }
+    return root;
+}
+
+QString FrameProbes::summary()
+{
+    QString res = QString("%1 %2 %3 %4 (ms)").arg("", -10).arg("p50", 7).arg("p95", 7).arg("p99", 7);
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        probe_stats_t s = stats(i);
+        res += QString("\n%1 %2 %3 %4")
+                   .arg(probeNames[i], -10)
+                   .arg(s.p50, 7, 'f', 2)
+                   .arg(s.p95, 7, 'f', 2)
+                   .arg(s.p99, 7, 'f', 2);
+    }
+    return res;
+}
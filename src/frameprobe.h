@@ -0,0 +1,77 @@
+#ifndef FRAME_PROBE_H
+#define FRAME_PROBE_H
+
+#include <QElapsedTimer>
+#include <QString>
+
+#include <vector>
+
+#include "json/json.h"
+
+// samples kept per probe, the histograms roll over this window
+#define FRAME_PROBE_SAMPLES 512
+
+enum frame_probe_e {
+    PROBE_PAINT = 0,
+    PROBE_HIGHLIGHT,
+    PROBE_GUTTER,
+    PROBE_MINIMAP,
+    PROBE_OVERLAY,
+    PROBE_COUNT
+};
+
+struct probe_stats_t {
+    int count;
+    double p50; // ms
+    double p95;
+    double p99;
+    double max;
+};
+
+// timings of the render and highlight paths. probes run on the gui
+// thread only, recording is a ring buffer write
+class FrameProbes {
+public:
+    static FrameProbes* instance();
+
+    FrameProbes();
+
+    void record(int probe, qint64 nsecs);
+    void reset();
+
+    probe_stats_t stats(int probe);
+    Json::Value toJson();
+    QString summary();
+
+    bool visible;
+
+private:
+    struct samples_t {
+        std::vector<qint64> nsecs;
+        size_t next;
+        int count;
+    };
+
+    samples_t samples[PROBE_COUNT];
+};
+
+// times the enclosing scope
+class FrameProbe {
+public:
+    FrameProbe(int probe)
+        : probe(probe)
+    {
+        timer.start();
+    }
+
+    ~FrameProbe()
+    {
+        FrameProbes::instance()->record(probe, timer.nsecsElapsed());
+    }
+
+private:
+    int probe;
+    QElapsedTimer timer;
+};
+
+#endif // FRAME_PROBE_H
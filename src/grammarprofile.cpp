@@ -0,0 +1,121 @@
+#include <QMutexLocker>
+
+#include <algorithm>
+
+#include "grammarprofile.h"
+#include "parse.h"
+#include "styles.h"
+
+GrammarProfile* GrammarProfile::instance()
+{
+    static GrammarProfile profile;
+    return &profile;
+}
+
+GrammarProfile::GrammarProfile()
+    : enabled(0)
+{
+}
+
+void GrammarProfile::setEnabled(bool enable)
+{
+    enabled = enable;
+}
+
+void GrammarProfile::record(parse::stack_ptr parser_state, std::map<size_t, scope::scope_t>& scopes, qint64 nsecs)
+{
+    // the bottom of the stack holds the grammar's root rule
+    const void* root = 0;
+    for (parse::stack_ptr s = parser_state; s; s = s->parent) {
+        if (s->rule) {
+            root = &*s->rule;
+        }
+    }
+    rule_key_t key(root, (parser_state && parser_state->rule) ? parser_state->rule->rule_id : 0);
+
+    // resolve ids before taking the lock, scope_id has its own
+    std::vector<int> ids;
+    for (auto& s : scopes) {
+        ids.push_back(scope_id(s.second));
+    }
+
+    QMutexLocker lock(&mutex);
+    auto it = rules.find(key);
+    if (it == rules.end()) {
+        rule_profile_t rule = {
+            .scope = ids.empty() ? 0 : ids.front(),
+            .lines = 0,
+            .matches = 0,
+            .nsecs = 0
+        };
+        it = rules.emplace(key, rule).first;
+    }
+
+    rule_profile_t& rule = it->second;
+    rule.lines++;
+    rule.nsecs += nsecs;
+
+    // the first entry is the scope carried in from the previous line
+    for (size_t i = 1; i < ids.size(); i++) {
+        rule.matches++;
+        rule.patterns[ids[i]]++;
+    }
+}
+
+void GrammarProfile::reset()
+{
+    QMutexLocker lock(&mutex);
+    rules.clear();
+}
+
+static std::string root_scope(std::string const& name)
+{
+    return name.substr(0, name.find(' '));
+}
+
+static std::string leaf_scope(std::string const& name)
+{
+    size_t pos = name.rfind(' ');
+    return pos == std::string::npos ? name : name.substr(pos + 1);
+}
+
+Json::Value GrammarProfile::toJson()
+{
+    std::vector<std::pair<rule_key_t, rule_profile_t>> sorted;
+    {
+        QMutexLocker lock(&mutex);
+        sorted.assign(rules.begin(), rules.end());
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) {
+        return a.second.nsecs > b.second.nsecs;
+    });
+
+    Json::Value root(Json::objectValue);
+    for (auto& r : sorted) {
+        rule_profile_t& rule = r.second;
+        std::string scope = scope_name(rule.scope);
+
+        Json::Value patterns(Json::objectValue);
+        for (auto& p : rule.patterns) {
+            patterns[leaf_scope(scope_name(p.first))] = (Json::UInt64)p.second;
+        }
+
+        Json::Value entry;
+        entry["start_rule"] = (Json::UInt64)r.first.second;
+        entry["scope"] = scope;
+        entry["lines"] = (Json::UInt64)rule.lines;
+        entry["matches"] = (Json::UInt64)rule.matches;
+        entry["ms"] = rule.nsecs / 1e6;
+        entry["patterns"] = patterns;
+
+        std::string grammar = scope.empty() ? "unknown" : root_scope(scope);
+        Json::Value& g = root[grammar];
+        g["lines"] = g["lines"].asUInt64() + rule.lines;
+        g["matches"] = g["matches"].asUInt64() + rule.matches;
+        g["ms"] = g["ms"].asDouble() + rule.nsecs / 1e6;
+        g["rules"].append(entry);
+    }
+
+    return root;
+}
@@ -0,0 +1,49 @@
+#ifndef GRAMMAR_PROFILE_H
+#define GRAMMAR_PROFILE_H
+
+#include <QAtomicInt>
+#include <QMutex>
+
+#include <map>
+
+#include "grammar.h"
+#include "json/json.h"
+
+struct rule_profile_t {
+    int scope; // scope in effect when the parser entered the rule
+    quint64 lines;
+    quint64 matches;
+    qint64 nsecs;
+    std::map<int, quint64> patterns; // matches per resulting scope
+};
+
+// opt-in per line profile of parser time. a line's time goes to the rule
+// on top of the stack the line starts from, keyed with its grammar as rule
+// ids are only unique per grammar. this tells which context lines are slow
+// in, not which pattern is: the parser is not hooked within a line.
+// matches are counted per resulting scope, which names the pattern that
+// fired
+class GrammarProfile {
+public:
+    static GrammarProfile* instance();
+
+    GrammarProfile();
+
+    void setEnabled(bool enable);
+    bool isEnabled() { return enabled.load(); }
+
+    void record(parse::stack_ptr parser_state, std::map<size_t, scope::scope_t>& scopes, qint64 nsecs);
+    void reset();
+
+    // grammars by root scope, their rules by descending time
+    Json::Value toJson();
+
+private:
+    QMutex mutex;
+    QAtomicInt enabled;
+    // grammar root rule, rule id
+    typedef std::pair<const void*, size_t> rule_key_t;
+    std::map<rule_key_t, rule_profile_t> rules;
+};
+
+#endif // GRAMMAR_PROFILE_H
@@ -1,34 +1,137 @@
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QFileInfo>
 #include <QTextDocument>
 
+#include <algorithm>
 #include <iostream>
+#include <unordered_map>
 
+#include "frameprobe.h"
 #include "highlighter.h"
 #include "mainwindow.h"
 #include "parse.h"
 #include "reader.h"
 #include "settings.h"
+#include "tokencache.h"
+
+// bounds for the number of lines snapshotted per tokenizer job
+#define TOKENIZER_MIN_JOB 64
+#define TOKENIZER_MAX_JOB 4096
+
+// time allowed per event loop turn for applying tokenized lines (ms)
+#define TOKENIZER_APPLY_BUDGET 8
+
+// pages past the viewport highlighted ahead of the scroll direction
+#define HIGHLIGHT_AHEAD_PAGES 2
+
+// blocks re-highlighted in place after an edit before the rest of the
+// cascade is handed to the tokenizer thread
+#define HIGHLIGHT_CASCADE_LIMIT 100
+
+// smaller documents tokenize quickly enough not to bother with the disk cache
+#define TOKEN_CACHE_MIN_BLOCKS 2000
 
 Highlighter::Highlighter(QTextDocument* parent)
     : QSyntaxHighlighter(parent)
     , theme(0)
     , grammar(0)
+    , commentFormat(0)
     , deferRendering(false)
+    , hasDirtyBlocks(false)
+    , visibleFirst(0)
+    , visibleLast(-1)
+    , scrollDirection(1)
+    , sweepBlock(0)
+    , documentRevision(0)
+    , cascadeBlock(-1)
+    , cascadeCount(0)
+    , statePool(std::make_shared<ParserStatePool>())
+    , lineMemo(std::make_shared<LineMemo>())
+    , blockStore(std::make_shared<BlockStore>())
+    , tokenizer(this)
+    , jobEnd(-1)
+    , jobApplied(-1)
+    , jobChanged(false)
+    , jobPending(false)
+    , jobFinished(false)
+    , jobExact(true)
+    , jobSize(TOKENIZER_MIN_JOB)
+    , tokenizedIndex(0)
+    , cacheRevision(-1)
+    , cacheSaved(false)
+    , restoreBlock(0)
+    , restoreEnd(-1)
+    , styleGeneration(0)
+    , restyling(false)
+    , restyleBlock(0)
 {
-    connect(&updateTimer, SIGNAL(timeout()), this, SLOT(onUpdate()));
+    connect(&updateTimer, SIGNAL(timeout()), this, SLOT(scheduleHighlight()));
     updateTimer.setSingleShot(true);
+
+    connect(&applyTimer, SIGNAL(timeout()), this, SLOT(applyTokenized()));
+    applyTimer.setSingleShot(true);
+
+    connect(&restoreTimer, SIGNAL(timeout()), this, SLOT(restoreSlice()));
+    restoreTimer.setSingleShot(true);
+
+    connect(&restyleTimer, SIGNAL(timeout()), this, SLOT(restyleSlice()));
+    restyleTimer.setSingleShot(true);
+
+    connect(&tokenizer, SIGNAL(tokenized()), this, SLOT(onTokenized()), Qt::QueuedConnection);
+    connect(parent, SIGNAL(contentsChange(int, int, int)), this, SLOT(onContentsChange(int, int, int)));
 }
 
 void Highlighter::setTheme(theme_ptr _theme)
 {
     theme = _theme;
+    if (!theme) {
+        return;
+    }
+
+    styles = theme_styles(theme);
     theme_color(theme, "editor.foreground", foregroundColor);
+
+    formatPool.clear();
+    scopeFormats.clear();
+    styleGeneration++;
+
+    style_t commentStyle = theme->styles_for_scope("comment");
+    commentFormat = formatForStyle(commentStyle, SCOPE_COMMENT);
 }
 
 void Highlighter::setLanguage(language_info_ptr _lang)
 {
+    tokenizer.cancel();
+    tokenizedLines.clear();
+    tokenizedIndex = 0;
+    jobPending = false;
+    jobFinished = false;
+    sweepBlock = 0;
+
+    bool changed = grammar && grammar != _lang->grammar;
     lang = _lang;
     grammar = _lang->grammar;
+    if (!changed) {
+        return;
+    }
+
+    // interned states and memoized lines belong to the old grammar, a job
+    // still running holds on to its own references
+    statePool = std::make_shared<ParserStatePool>();
+    lineMemo = std::make_shared<LineMemo>();
+    for (QTextBlock block = document()->begin(); block.isValid(); block = block.next()) {
+        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+        if (blockData) {
+            blockData->state = 0;
+            blockData->signature = 0;
+            blockData->tokenized = false;
+            blockData->dirty = true;
+        }
+    }
+    hasDirtyBlocks = true;
+    scheduleHighlight();
 }
 
 void Highlighter::setDeferRendering(bool defer)
@@ -36,59 +139,127 @@ void Highlighter::setDeferRendering(bool defer)
     deferRendering = defer;
 }
 
-void Highlighter::setFormatFromStyle(size_t start, size_t length, style_t& style, const char* line, HighlightBlockData* blockData, std::string scope)
+void Highlighter::setForeground(bool foreground)
+{
+    tokenizer.setForeground(foreground);
+}
+
+format_info_t* Highlighter::formatForStyle(style_t& style, int kind)
 {
-    // std::cout << scope << std::endl;
-    // std::cout << to_s(style.scope_selector) << std::endl;
+    bool apply = (style.bold == bool_true || style.italic == bool_true || style.underlined == bool_true || style.strikethrough == bool_true || !style.foreground.is_blank());
+
+    QColor clr = QColor(style.foreground.red * 255, style.foreground.green * 255, style.foreground.blue * 255, 255);
+    if (style.foreground.is_blank()) {
+        clr = foregroundColor;
+    }
+
+    quint64 key = clr.rgb() & 0xffffff;
+    if (apply) {
+        key |= (quint64)(style.bold == bool_true) << 24;
+        key |= (quint64)(style.italic == bool_true) << 25;
+        key |= (quint64)(style.underlined == bool_true) << 26;
+        key |= (quint64)(style.strikethrough == bool_true) << 27;
+        key |= (quint64)kind << 28;
+        key |= (quint64)1 << 32;
+    }
 
-    QColor clr;
-    if (style.bold == bool_true || style.italic == bool_true || style.underlined == bool_true || style.strikethrough == bool_true || !style.foreground.is_blank()) {
-        clr = QColor(style.foreground.red * 255, style.foreground.green * 255, style.foreground.blue * 255, 255);
-        QTextCharFormat f;
+    auto it = formatPool.find(key);
+    if (it != formatPool.end()) {
+        return &it->second;
+    }
+
+    format_info_t& format = formatPool[key];
+    format.apply = apply;
+    format.color = clr;
+
+    if (apply) {
+        QTextCharFormat& f = format.format;
         f.setFontWeight(style.bold == bool_true ? QFont::Medium : QFont::Normal);
         f.setFontItalic(style.italic == bool_true);
         f.setFontUnderline(style.underlined == bool_true);
         f.setFontStrikeOut(style.strikethrough == bool_true);
-        f.setForeground(clr);
+        f.setForeground(QColor(style.foreground.red * 255, style.foreground.green * 255, style.foreground.blue * 255, 255));
+        f.setProperty(SCOPE_PROPERTY_ID, kind);
+    }
 
-        if (scope.find("comment") != std::string::npos) {
-            f.setProperty(SCOPE_PROPERTY_ID, SCOPE_COMMENT);
-        } else if (scope.find("string") != std::string::npos) {
-            f.setProperty(SCOPE_PROPERTY_ID, SCOPE_STRING);
-        } else {
-            f.setProperty(SCOPE_PROPERTY_ID, SCOPE_OTHER);
-        }
+    return &format;
+}
 
-        setFormat(start, length, f);
+format_info_t* Highlighter::formatForScope(int scope)
+{
+    if (scope >= scopeFormats.size()) {
+        scopeFormats.resize(scope + 1, NULL);
     }
 
-    if (style.foreground.is_blank()) {
-        clr = foregroundColor;
+    format_info_t* format = scopeFormats[scope];
+    if (!format) {
+        format = formatForStyle(styles->style(scope), styles->kind(scope));
+        scopeFormats[scope] = format;
     }
+    return format;
+}
 
-    // for minimap
-    int s = -1;
-    for (int i = start; i < start + length; i++) {
-        if (s == -1) {
-            if (line[i] != ' ' && line[i] != '\t') {
-                s = i;
-            }
-            continue;
+void Highlighter::setFormatFromStyle(size_t start, size_t length, format_info_t* format)
+{
+    if (format->apply) {
+        setFormat(start, length, format->format);
+    }
+}
+
+const std::vector<span_info_t>& Highlighter::minimapSpans(QTextBlock& block)
+{
+    static const std::vector<span_info_t> none;
+
+    HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+    if (!blockData || !styles) {
+        return none;
+    }
+
+    std::vector<span_info_t>& spans = blockData->spans;
+    if (blockData->spansRevision == blockData->revision) {
+        return spans;
+    }
+    blockData->spansRevision = blockData->revision;
+    spans.clear();
+
+    QString text = block.text();
+    const QChar* line = text.constData();
+    int length = text.length();
+
+    for (auto token : blockData->tokens()) {
+        int start = token.start;
+        int end = std::min((int)(token.start + token.length), length);
+        format_info_t* format = formatForScope(token.scope);
+        if (start < blockData->commentEnd && end > blockData->commentBegin) {
+            format = commentFormat;
         }
-        if (line[i] == ' ' || i + 1 == start + length) {
+
+        QColor& clr = format->color;
+
+        // words of the run, split at whitespace
+        int s = -1;
+        for (int i = start; i <= end; i++) {
+            ushort c = i < end ? line[i].unicode() : ' ';
+            if (c != ' ' && c != '\t') {
+                if (s == -1) {
+                    s = i;
+                }
+                continue;
+            }
             if (s != -1) {
                 span_info_t span = {
                     .start = s,
-                    .length = i - s + 1,
+                    .length = i - s,
                     .red = clr.red(),
                     .green = clr.green(),
                     .blue = clr.blue()
                 };
-                blockData->spans.push_back(span);
+                spans.push_back(span);
+                s = -1;
             }
-            s = -1;
         }
     }
+    return spans;
 }
 
 void Highlighter::highlightBlock(const QString& text)
@@ -97,8 +268,6 @@ void Highlighter::highlightBlock(const QString& text)
         return;
     }
 
-    editor_settings_ptr settings = MainWindow::instance()->editor_settings;
-
     // std::cout << "highlightBlock" << std::endl;
 
     bool firstLine = true;
@@ -112,21 +281,24 @@ void Highlighter::highlightBlock(const QString& text)
         if (deferRendering) {
             return;
         }
-        blockData = new HighlightBlockData;
+        blockData = new HighlightBlockData(blockStore);
     }
 
-    blockData->buffer = QPixmap();
+    FrameProbe probe(PROBE_HIGHLIGHT);
 
-    std::map<size_t, scope::scope_t> scopes;
-    blockData->scopes.clear();
+    // the tokenizer thread is about to deliver this one. returning without
+    // formats would clear the block, so it keeps its current tokens till then
+    int blockNumber = currentBlock().blockNumber();
+    bool pending = jobPending && !blockData->tokenized && blockNumber > jobApplied && blockNumber <= jobEnd && document()->revision() == documentRevision;
+
+    QPixmapCache::remove(blockData->buffer);
+    blockData->buffer = QPixmapCache::Key();
+    blockData->revision++;
 
     QTextBlock prevBlock = currentBlock().previous();
     HighlightBlockData* prevBlockData = reinterpret_cast<HighlightBlockData*>(prevBlock.userData());
     if (prevBlockData) {
-        parser_state = prevBlockData->parser_state;
-        if (parser_state->rule) {
-            blockData->lastPrevBlockRule = parser_state->rule->rule_id;
-        }
+        parser_state = statePool->state(prevBlockData->state);
         firstLine = !(parser_state != NULL);
     }
 
@@ -135,53 +307,83 @@ void Highlighter::highlightBlock(const QString& text)
         firstLine = true;
     }
 
+    // restored from the cache, the line above has tokens but no parser state
+    bool unknownState = prevBlockData && !prevBlockData->state && prevBlockData->signature;
+
     //----------------------
     // parse the line
     //----------------------
-    std::string str = text.toStdString();
-    str += "\n";
-
-    const char* first = str.c_str();
-    const char* last = first + text.length() + 1;
+    // token offsets are in QChars, up to and including the "\n"
+    const QChar* first = text.constData();
 
     // std::cout << str << "<<<<" << std::endl;
 
-    if (text.length() > 500) {
-        // that would be too long to parse (unminify first)
+    bool cascading = false;
+    if (blockData->tokenized) {
+        // already parsed by the tokenizer thread
+        blockData->tokenized = false;
+        cascadeCount = 0;
+    } else if (restyling || pending) {
+        // only the formats are applied again, tokens and state are left as is
+    } else if (unknownState) {
+        // the line keeps its old tokens till the tokenizer thread has worked
+        // its way down from the last known state
+        blockData->state = 0;
+        blockData->signature = 0;
+        blockData->provisional = true;
+        blockData->restored = false;
+        if (!updateTimer.isActive()) {
+            updateTimer.start(0);
+        }
+    } else if (text.length() > TOKENIZER_LONG_LINE) {
+        // too long to parse here, carry the state through for now and
+        // leave the line to the tokenizer thread
+        scratchTokens.clear();
+        blockData->store->setTokens(blockData->tokenRange, scratchTokens);
+        blockData->state = statePool->intern(parser_state);
+        blockData->provisional = true;
+        blockData->restored = false;
+        if (!updateTimer.isActive()) {
+            updateTimer.start(0);
+        }
     } else {
-        parser_state = parse::parse(first, last, parser_state, scopes, firstLine);
-    }
-
-    blockData->spans.clear();
-
-    std::string prevScopeName;
-    size_t si = 0;
-    size_t n = 0;
-    std::map<size_t, scope::scope_t>::iterator it = scopes.begin();
-    while (it != scopes.end()) {
-        n = it->first;
-        scope::scope_t scope = it->second;
-
-        if (settings->debug_scopes) {
-            blockData->scopes.emplace(n, scope);
+        int startState = firstLine ? 0 : prevBlockData->state;
+        int endState;
+        bool parsed = true;
+        if (lineMemo->lookup(startState, text, scratchTokens, endState)) {
+            parser_state = statePool->state(endState);
+        } else {
+            lineBuffer.assign(text);
+            parsed = try_tokenize_line(lineBuffer, parser_state, firstLine, scratchTokens);
+            if (parsed) {
+                endState = statePool->intern(parser_state);
+                lineMemo->store(startState, text, scratchTokens, endState);
+            }
         }
 
-        std::string scopeName = to_s(scope);
-        it++;
+        if (parsed) {
+            blockData->store->setTokens(blockData->tokenRange, scratchTokens);
+            blockData->state = endState;
+            blockData->restored = false;
+            blockData->provisional = prevBlock.isValid() && (!prevBlockData || prevBlockData->dirty || prevBlockData->provisional);
 
-        if (n > si) {
-            style_t s = theme->styles_for_scope(prevScopeName);
-            setFormatFromStyle(si, n - si, s, first, blockData, prevScopeName);
+            cascading = (blockNumber == cascadeBlock + 1);
+            cascadeCount = cascading ? cascadeCount + 1 : 0;
+        } else {
+            // a tokenizer thread is parsing with the grammar, rather than
+            // wait the line keeps its old tokens and is left to the threads
+            blockData->provisional = true;
+            blockData->restored = false;
+            if (!updateTimer.isActive()) {
+                updateTimer.start(0);
+            }
         }
-
-        prevScopeName = scopeName;
-        si = n;
     }
+    cascadeBlock = blockNumber;
 
-    n = last - first;
-    if (n > si) {
-        style_t s = theme->styles_for_scope(prevScopeName);
-        setFormatFromStyle(si, n - si, s, first, blockData, prevScopeName);
+    token_view_t tokens = blockData->tokens();
+    for (auto token : tokens) {
+        setFormatFromStyle(token.start, token.length, formatForScope(token.scope));
     }
 
     //----------------------
@@ -192,10 +394,11 @@ void Highlighter::highlightBlock(const QString& text)
     // find block comments
     //----------------------
     QTextCharFormat format;
+    int commentBegin = 0;
+    int commentEnd = 0;
     if (lang->blockCommentStart.length()) {
         int beginComment = text.indexOf(lang->blockCommentStart.c_str());
         int endComment = text.indexOf(lang->blockCommentEnd.c_str());
-        style_t s = theme->styles_for_scope("comment");
 
         if (beginComment != -1) {
             format = QSyntaxHighlighter::format(beginComment);
@@ -204,15 +407,19 @@ void Highlighter::highlightBlock(const QString& text)
             }
         }
 
-        if (endComment == -1 && (beginComment != -1 || previousBlockState() == BLOCK_STATE_COMMENT)) {
-            setCurrentBlockState(BLOCK_STATE_COMMENT);
+        bool prevComment = prevBlockData && (prevBlockData->blockState & BLOCK_STATE_COMMENT);
+        if (endComment == -1 && (beginComment != -1 || prevComment)) {
+            blockData->blockState = BLOCK_STATE_COMMENT;
             int b = beginComment != -1 ? beginComment : 0;
-            int e = endComment != -1 ? endComment : (last - first);
-            setFormatFromStyle(b, e - b, s, first, blockData, "comment");
+            int e = endComment != -1 ? endComment : text.length();
+            setFormatFromStyle(b, e - b, commentFormat);
+            commentBegin = b;
+            commentEnd = e;
         } else {
-            setCurrentBlockState(0);
-            if (endComment != -1 && previousBlockState() == BLOCK_STATE_COMMENT) {
-                setFormatFromStyle(0, endComment + lang->blockCommentEnd.length(), s, first, blockData, "comment");
+            blockData->blockState = 0;
+            if (endComment != -1 && prevComment) {
+                setFormatFromStyle(0, endComment + lang->blockCommentEnd.length(), commentFormat);
+                commentEnd = endComment + lang->blockCommentEnd.length();
             }
         }
     }
@@ -220,146 +427,623 @@ void Highlighter::highlightBlock(const QString& text)
     //----------------------
     // gather brackets
     //----------------------
-    blockData->brackets.clear();
     blockData->foldable = false;
-    blockData->foldingBrackets.clear();
+    blockData->line = currentBlock().firstLineNumber();
+    blockData->commentBegin = commentBegin;
+    blockData->commentEnd = commentEnd;
+    scratchBrackets.clear();
+    scratchFolding.clear();
     if (lang->brackets) {
-        std::vector<bracket_info_t> brackets;
-        for (char* c = (char*)first; c < last;) {
-            bool found = false;
-
-            format = QSyntaxHighlighter::format(c - first);
-            int prop = format.intProperty(SCOPE_PROPERTY_ID);
-            if (prop == SCOPE_COMMENT || prop == SCOPE_STRING) {
-                c++;
-                continue;
-            }
-
-            // opening
-            int i = 0;
-            for (auto b : lang->bracketOpen) {
-                if (strstr(c, b.c_str()) == c) {
-                    found = true;
-                    size_t l = (c - first);
-                    brackets.push_back({ .line = currentBlock().firstLineNumber(),
-                        .position = l,
-                        .bracket = i,
-                        .open = true });
-                    c += b.length();
-                    break;
+        // scan runs of code, skipping strings and comments wholesale
+        scratchMatches.clear();
+        size_t runStart = 0;
+        size_t runEnd = 0;
+        for (auto token : tokens) {
+            int kind = styles->kind(token.scope);
+            if (kind == SCOPE_COMMENT || kind == SCOPE_STRING) {
+                if (runEnd > runStart) {
+                    lang->bracketMatcher.scan(first, runStart, runEnd, scratchMatches);
                 }
-            }
-
-            if (found) {
+                runStart = token.start + token.length;
                 continue;
             }
+            runEnd = token.start + token.length;
+        }
+        if (runEnd > runStart) {
+            lang->bracketMatcher.scan(first, runStart, runEnd, scratchMatches);
+        }
+        if (tokens.empty()) {
+            lang->bracketMatcher.scan(first, 0, text.length(), scratchMatches);
+        }
 
-            // closing
-            i = 0;
-            for (auto b : lang->bracketClose) {
-                if (strstr(c, b.c_str()) == c) {
-                    found = true;
-                    size_t l = (c - first);
-                    brackets.push_back({ .line = currentBlock().firstLineNumber(),
-                        .position = l,
-                        .bracket = i,
-                        .open = false });
-                    c += b.length();
-                    break;
-                }
-            }
-
-            if (found) {
+        for (auto& m : scratchMatches) {
+            if ((int)m.position >= commentBegin && (int)m.position < commentEnd) {
                 continue;
             }
-
-            c++;
+            scratchBrackets.push_back({ .line = (size_t)blockData->line,
+                .position = m.position,
+                .bracket = m.bracket,
+                .open = m.open });
         }
 
-        blockData->brackets = brackets;
-
         // bracket pairing
-        for (auto b : brackets) {
-            if (!b.open && blockData->foldingBrackets.size()) {
-                auto l = blockData->foldingBrackets.back();
+        for (auto& b : scratchBrackets) {
+            if (!b.open && scratchFolding.size()) {
+                auto l = scratchFolding.back();
                 if (l.open && l.bracket == b.bracket) {
-                    blockData->foldingBrackets.pop_back();
+                    scratchFolding.pop_back();
                 } else {
                     // std::cout << "error brackets" << std::endl;
                 }
                 continue;
             }
-            blockData->foldingBrackets.push_back(b);
+            scratchFolding.push_back(b);
         }
 
         // hack for if-else-
-        if (blockData->foldingBrackets.size() == 2) {
-            if (blockData->foldingBrackets[0].open != blockData->foldingBrackets[1].open && blockData->foldingBrackets[0].bracket == blockData->foldingBrackets[1].bracket) {
-                blockData->foldingBrackets.clear();
+        if (scratchFolding.size() == 2) {
+            if (scratchFolding[0].open != scratchFolding[1].open && scratchFolding[0].bracket == scratchFolding[1].bracket) {
+                scratchFolding.clear();
             }
         }
 
         // format brackets with scope
         // style_t s = theme->styles_for_scope("bracket");
-        // for (auto b : blockData->brackets) {
-        // setFormatFromStyle(b.position, 1, s, first, blockData, "bracket");
+        // for (auto b : scratchBrackets) {
+        // setFormatFromStyle(b.position, 1, formatForStyle(s, SCOPE_OTHER));
         // }
 
-        if (blockData->foldingBrackets.size()) {
-            auto l = blockData->foldingBrackets.back();
+        if (scratchFolding.size()) {
+            auto l = scratchFolding.back();
             blockData->foldable = l.open;
         }
     }
+    blockData->store->setBrackets(blockData->bracketRange, scratchBrackets);
+    blockData->store->setBrackets(blockData->foldingRange, scratchFolding);
 
-    blockData->parser_state = parser_state;
-    blockData->dirty = false;
+    if (!pending) {
+        blockData->dirty = false;
+    }
+    blockData->style = styleGeneration;
     currentBlock().setUserData(blockData);
 
     //----------------------
-    // mark next block for highlight
-    // .. if necessary
+    // stop on equal state
     //----------------------
-    if (parser_state->rule && !updateTimer.isActive()) {
+    // QSyntaxHighlighter moves on to the next block for as long as the
+    // block state changes. the state carries the interned parser state id
+    // so an edit re-highlights forward only until the states meet again
+    int newState = (blockData->state << BLOCK_STATE_SHIFT) | blockData->blockState;
+    if (newState != currentBlockState() && cascading && cascadeCount > HIGHLIGHT_CASCADE_LIMIT) {
+        // too long for this turn, leave the rest to the scheduler
         QTextBlock next = currentBlock().next();
-        if (next.isValid()) {
-            HighlightBlockData* nextBlockData = reinterpret_cast<HighlightBlockData*>(next.userData());
-            if (nextBlockData && parser_state->rule->rule_id != nextBlockData->lastPrevBlockRule) {
+        HighlightBlockData* nextBlockData = reinterpret_cast<HighlightBlockData*>(next.userData());
+        if (nextBlockData) {
+            nextBlockData->dirty = true;
+            hasDirtyBlocks = true;
+            if (next.blockNumber() < sweepBlock) {
+                sweepBlock = next.blockNumber();
+            }
+            if (!updateTimer.isActive()) {
+                updateTimer.start(0);
+            }
+            newState = currentBlockState();
+        }
+    }
+    setCurrentBlockState(newState);
+}
+
+//----------------------
+// highlight scheduler
+//----------------------
+void Highlighter::setVisibleRange(int first, int last)
+{
+    if (first == visibleFirst && last == visibleLast) {
+        return;
+    }
+
+    if (first != visibleFirst) {
+        scrollDirection = first < visibleFirst ? -1 : 1;
+    }
+
+    visibleFirst = first;
+    visibleLast = last;
+
+    if (!updateTimer.isActive()) {
+        updateTimer.start(0);
+    }
+}
+
+bool Highlighter::needsHighlight(QTextBlock& block)
+{
+    HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+    return !blockData || blockData->dirty || blockData->provisional;
+}
+
+void Highlighter::scheduleHighlight()
+{
+    if (!grammar || jobPending) {
+        return;
+    }
+
+    QTextDocument* doc = document();
+    documentRevision = doc->revision();
+
+    // visible blocks first
+    if (visibleLast >= visibleFirst) {
+        if (tokenizeRange(visibleFirst, visibleLast)) {
+            return;
+        }
+
+        // then the region we are scrolling towards
+        int ahead = (visibleLast - visibleFirst + 1) * HIGHLIGHT_AHEAD_PAGES;
+        if (scrollDirection < 0) {
+            if (tokenizeRange(visibleFirst - ahead, visibleFirst - 1)) {
+                return;
+            }
+        } else {
+            if (tokenizeRange(visibleLast + 1, visibleLast + ahead)) {
+                return;
+            }
+        }
+
+        // and a page back the other way, for paging
+        int page = visibleLast - visibleFirst + 1;
+        if (scrollDirection < 0) {
+            if (tokenizeRange(visibleLast + 1, visibleLast + page)) {
+                return;
+            }
+        } else {
+            if (tokenizeRange(visibleFirst - page, visibleFirst - 1)) {
+                return;
+            }
+        }
+    }
+
+    // then the rest, in document order
+    QTextBlock block = doc->findBlockByNumber(sweepBlock);
+    if (!block.isValid()) {
+        block = doc->begin();
+    }
+    while (block.isValid() && !needsHighlight(block)) {
+        block = block.next();
+    }
+
+    if (!block.isValid()) {
+        // all done
+        sweepBlock = doc->blockCount();
+        if (hasDirtyBlocks || deferRendering) {
+            hasDirtyBlocks = false;
+            setDeferRendering(false);
+            emit highlightProgress();
+            saveTokens();
+        }
+        return;
+    }
+
+    sweepBlock = block.blockNumber();
+    tokenizeRange(sweepBlock, doc->blockCount() - 1);
+}
+
+bool Highlighter::tokenizeRange(int start, int end)
+{
+    QTextDocument* doc = document();
+    if (start < 0) {
+        start = 0;
+    }
+    if (end >= doc->blockCount()) {
+        end = doc->blockCount() - 1;
+    }
+
+    QTextBlock block = doc->findBlockByNumber(start);
+    while (block.isValid() && block.blockNumber() <= end && !needsHighlight(block)) {
+        block = block.next();
+    }
+    if (!block.isValid() || block.blockNumber() > end) {
+        return false;
+    }
+
+    // blocks restored from the cache have tokens but no parser state. the
+    // job starts from the last block whose state is known, and runs over
+    // the restored ones up to this block
+    int target = block.blockNumber();
+    while (block.previous().isValid()) {
+        HighlightBlockData* prevBlockData = reinterpret_cast<HighlightBlockData*>(block.previous().userData());
+        if (!prevBlockData || prevBlockData->state || !prevBlockData->signature) {
+            break;
+        }
+        block = block.previous();
+    }
+
+    // start from the previous block's state. if that one is not known yet,
+    // guess and let the document order sweep correct it later
+    bool exact = true;
+    parse::stack_ptr parser_state = NULL;
+    QTextBlock prevBlock = block.previous();
+    if (prevBlock.isValid()) {
+        HighlightBlockData* prevBlockData = reinterpret_cast<HighlightBlockData*>(prevBlock.userData());
+        if (prevBlockData) {
+            parser_state = statePool->state(prevBlockData->state);
+        }
+        exact = prevBlockData && !prevBlockData->dirty && !prevBlockData->provisional;
+    }
+    if (!parser_state) {
+        parser_state = grammar->seed();
+    }
+
+    // exact jobs run on past blocks that look fine, the tokenizer stops
+    // as soon as it reaches a state equal to the one stored
+    std::vector<line_snapshot_t> lines;
+    // past the target, a restored block whose end state comes out as stored
+    // ends the job like a known one would
+    while (block.isValid() && block.blockNumber() <= end && lines.size() < jobSize) {
+        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+        if (!exact && !needsHighlight(block) && block.blockNumber() > target) {
+            break;
+        }
+        bool restored = blockData && !blockData->state && block.blockNumber() > target;
+        lines.push_back({ .number = block.blockNumber(),
+            .revision = block.revision(),
+            .text = block.text(),
+            .parser_state = blockData ? statePool->state(blockData->state) : NULL,
+            .signature = restored ? blockData->signature : 0 });
+        block = block.next();
+    }
+
+    jobPending = true;
+    jobExact = exact;
+    jobEnd = lines.back().number;
+    jobApplied = lines.front().number - 1;
+    jobChanged = false;
+    hasDirtyBlocks = true;
+    tokenizer.tokenize(statePool, lineMemo, parser_state, lines);
+    return true;
+}
+
+void Highlighter::onTokenized()
+{
+    if (tokenizer.takeResults(tokenizedLines)) {
+        jobFinished = true;
+    }
+    if (!applyTimer.isActive()) {
+        applyTokenized();
+    }
+}
+
+void Highlighter::applyTokenized()
+{
+    QTextDocument* doc = document();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while (tokenizedIndex < tokenizedLines.size()) {
+        tokenized_line_t& line = tokenizedLines[tokenizedIndex++];
+
+        QTextBlock block = doc->findBlockByNumber(line.number);
+        if (block.isValid() && block.revision() == line.revision) {
+            HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+            if (!blockData) {
+                blockData = new HighlightBlockData(blockStore);
+                block.setUserData(blockData);
+            }
+            if (blockData->state || !blockData->signature) {
+                jobChanged = (blockData->state != line.state);
+            } else {
+                jobChanged = (blockData->signature != state_signature(line.parser_state));
+            }
+            if (blockData->restored && !blockData->tokenized && blockStore->sameTokens(blockData->tokenRange, line.tokens)) {
+                // restored from the cache and already formatted the same way,
+                // only the state was missing
+                blockData->state = line.state;
+                blockData->provisional = !jobExact;
+                blockData->restored = !jobExact;
+                block.setUserState((line.state << BLOCK_STATE_SHIFT) | blockData->blockState);
+                jobApplied = line.number;
+                continue;
+            }
+            blockStore->setTokens(blockData->tokenRange, line.tokens);
+            blockData->restored = false;
+            blockData->state = line.state;
+            blockData->tokenized = true;
+            blockData->provisional = !jobExact;
+            jobApplied = line.number;
+            rehighlightBlock(block);
+        }
+
+        if (timer.elapsed() > TOKENIZER_APPLY_BUDGET) {
+            break;
+        }
+    }
+
+    emit highlightProgress();
+
+    if (tokenizedIndex < tokenizedLines.size()) {
+        applyTimer.start(0);
+        return;
+    }
+
+    size_t done = tokenizedLines.size();
+    tokenizedLines.clear();
+    tokenizedIndex = 0;
+
+    if (jobFinished) {
+        QTextBlock next = doc->findBlockByNumber(jobApplied + 1);
+        HighlightBlockData* nextBlockData = reinterpret_cast<HighlightBlockData*>(next.userData());
+        if (nextBlockData) {
+            if (jobChanged) {
+                // the state after the job moved, carry on from here
                 nextBlockData->dirty = true;
-                hasDirtyBlocks = true;
-                updateTimer.start(100);
-                // qDebug() << "dirty" << next.firstLineNumber();
+            } else if (jobExact) {
+                // met an equal state, whatever was guessed after it holds
+                while (nextBlockData && nextBlockData->provisional && !nextBlockData->dirty) {
+                    nextBlockData->provisional = false;
+                    next = next.next();
+                    nextBlockData = reinterpret_cast<HighlightBlockData*>(next.userData());
+                }
             }
         }
+
+        // size the next job after what the tokenizer managed this time
+        jobSize = done * 2;
+        if (jobSize < TOKENIZER_MIN_JOB) {
+            jobSize = TOKENIZER_MIN_JOB;
+        }
+        if (jobSize > TOKENIZER_MAX_JOB) {
+            jobSize = TOKENIZER_MAX_JOB;
+        }
+
+        jobPending = false;
+        jobFinished = false;
+        updateTimer.start(0);
     }
 }
 
-void Highlighter::onUpdate()
+void Highlighter::onContentsChange(int position, int removed, int added)
 {
-    if (!hasDirtyBlocks) {
+    // format changes (including our own) do not bump the revision
+    QTextDocument* doc = document();
+    if (doc->revision() == documentRevision) {
+        return;
+    }
+    documentRevision = doc->revision();
+
+    int editedBlock = doc->findBlock(position).blockNumber();
+    if (editedBlock >= 0 && editedBlock < sweepBlock) {
+        sweepBlock = editedBlock;
+    }
+
+    if (!jobPending) {
         return;
     }
 
-    int rendered = 0;
+    // text edited while tokenizing, drop the job and reschedule
+    tokenizer.cancel();
+    tokenizedLines.clear();
+    tokenizedIndex = 0;
+    jobPending = false;
+    jobFinished = false;
+
+    updateTimer.start(0);
+}
+
+//----------------------
+// token cache
+//----------------------
+QString Highlighter::grammarKey()
+{
+    if (!lang) {
+        return QString();
+    }
+
+    // a different grammar file (or an edited one) invalidates the cache
+    QFileInfo info(QString::fromStdString(lang->grammarPath));
+    return QString("%1|%2|%3|%4")
+        .arg(QString::fromStdString(lang->id))
+        .arg(info.absoluteFilePath())
+        .arg(info.lastModified().toMSecsSinceEpoch())
+        .arg(info.size());
+}
+
+void Highlighter::setCacheFile(const QString& fileName)
+{
+    // the cache is only written while the document matches the file
+    cacheFile = fileName;
+    cacheRevision = document()->revision();
+    cacheSaved = false;
+    cacheKey.clear();
+    if (!fileName.isEmpty() && document()->blockCount() >= TOKEN_CACHE_MIN_BLOCKS) {
+        cacheKey = token_cache_key(fileName);
+    }
+}
+
+bool Highlighter::restoreTokens()
+{
+    if (cacheKey.isEmpty() || !grammar) {
+        return false;
+    }
+
+    QTextDocument* doc = document();
+    if (doc->blockCount() < TOKEN_CACHE_MIN_BLOCKS) {
+        return false;
+    }
 
-    if (!updateIterator.isValid()) {
-        QTextDocument* doc = document();
-        updateIterator = doc->begin();
+    token_cache_t cache;
+    cache.grammar = grammarKey();
+    if (!load_token_cache(cacheKey, cache)) {
+        return false;
     }
 
-    while (updateIterator.isValid() && rendered < 200) {
-        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(updateIterator.userData());
-        if (blockData && blockData->dirty) {
-            rendered++;
-            // qDebug() << "update" << updateIterator.firstLineNumber();
-            rehighlightBlock(updateIterator);
+    std::vector<int> scopeIds;
+    for (auto& name : cache.scopeNames) {
+        scopeIds.push_back(scope_id_for_name(name));
+    }
+
+    // take lines up to the first one that differs, the tokenizer picks
+    // up from there as with any other unhighlighted block. restored lines
+    // are not tokenized again, their parser states are only worked out
+    // when a line below them needs one
+    int restored = 0;
+    QTextBlock block = doc->begin();
+    while (block.isValid() && restored < cache.lineHashes.size()) {
+        if (qHash(block.text()) != cache.lineHashes[restored]) {
+            break;
+        }
+
+        scratchTokens.clear();
+        for (uint32_t i = cache.lineTokens[restored]; i < cache.lineTokens[restored + 1]; i++) {
+            token_t token = cache.tokens[i];
+            token.scope = scopeIds[token.scope];
+            scratchTokens.push_back(token);
         }
-        updateIterator = updateIterator.next();
+
+        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+        if (!blockData) {
+            blockData = new HighlightBlockData(blockStore);
+            block.setUserData(blockData);
+        }
+        blockStore->setTokens(blockData->tokenRange, scratchTokens);
+        blockData->tokenized = true;
+        blockData->restored = true;
+        blockData->provisional = false;
+        blockData->dirty = false;
+        blockData->state = 0;
+        blockData->signature = cache.states[cache.lineStates[restored]];
+
+        restored++;
+        block = block.next();
     }
 
-    if (rendered == 0) {
-        hasDirtyBlocks = false;
-        // qDebug() << "end updates";
-    } else {
-        updateTimer.start(100);
+    if (!restored) {
+        return false;
     }
+
+    restoreBlock = 0;
+    restoreEnd = restored - 1;
+    restoreSlice();
+    return true;
+}
+
+void Highlighter::restoreSlice()
+{
+    QTextDocument* doc = document();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QTextBlock block = doc->findBlockByNumber(restoreBlock);
+    while (block.isValid() && restoreBlock <= restoreEnd) {
+        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+        if (blockData && blockData->restored && blockData->tokenized) {
+            rehighlightBlock(block);
+        }
+        restoreBlock++;
+        block = block.next();
+
+        if (timer.elapsed() > TOKENIZER_APPLY_BUDGET) {
+            break;
+        }
+    }
+
+    emit highlightProgress();
+
+    if (block.isValid() && restoreBlock <= restoreEnd) {
+        restoreTimer.start(0);
+    }
+}
+
+//----------------------
+// restyle
+//----------------------
+// a theme change re-maps scopes to formats from the stored tokens instead
+// of parsing again. the visible blocks go first, the rest follow in slices
+void Highlighter::restyle()
+{
+    restyleBlock = 0;
+    restyleSlice();
+}
+
+int Highlighter::restyleBlocks(int start, int end, int budget)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QTextBlock block = document()->findBlockByNumber(start);
+    while (block.isValid() && block.blockNumber() <= end) {
+        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+        if (blockData && !blockData->dirty && blockData->style != styleGeneration) {
+            restyling = !blockData->tokenized;
+            rehighlightBlock(block);
+            restyling = false;
+        }
+        block = block.next();
+
+        if (budget >= 0 && timer.elapsed() > budget) {
+            break;
+        }
+    }
+
+    return block.isValid() ? block.blockNumber() : document()->blockCount();
+}
+
+void Highlighter::restyleSlice()
+{
+    // whatever is on screen goes first, budget or not
+    restyleBlocks(visibleFirst, visibleLast, -1);
+    restyleBlock = restyleBlocks(restyleBlock, document()->blockCount() - 1, TOKENIZER_APPLY_BUDGET);
+
+    emit highlightProgress();
+
+    if (restyleBlock < document()->blockCount()) {
+        restyleTimer.start(0);
+    }
+}
+
+void Highlighter::saveTokens()
+{
+    QTextDocument* doc = document();
+    if (cacheKey.isEmpty() || cacheSaved || doc->revision() != cacheRevision || doc->blockCount() < TOKEN_CACHE_MIN_BLOCKS) {
+        return;
+    }
+    cacheSaved = true;
+
+    token_cache_t cache;
+    cache.grammar = grammarKey();
+
+    std::vector<int> scopeIndex;
+    std::unordered_map<quint64, uint32_t> stateIndex;
+    QTextBlock block = doc->begin();
+    while (block.isValid()) {
+        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+        if (!blockData || blockData->dirty || blockData->provisional) {
+            return;
+        }
+
+        // lines still as restored keep the signature they came with
+        quint64 signature = blockData->state ? state_signature(statePool->state(blockData->state)) : blockData->signature;
+        auto it = stateIndex.find(signature);
+        if (it == stateIndex.end()) {
+            it = stateIndex.emplace(signature, cache.states.size()).first;
+            cache.states.push_back(signature);
+        }
+        cache.lineStates.push_back(it->second);
+
+        cache.lineHashes.push_back(qHash(block.text()));
+        cache.lineTokens.push_back(cache.tokens.size());
+        for (auto token : blockData->tokens()) {
+            if (token.scope >= scopeIndex.size()) {
+                scopeIndex.resize(token.scope + 1, -1);
+            }
+            if (scopeIndex[token.scope] == -1) {
+                scopeIndex[token.scope] = cache.scopeNames.size();
+                cache.scopeNames.push_back(scope_name(token.scope));
+            }
+            token.scope = scopeIndex[token.scope];
+            cache.tokens.push_back(token);
+        }
+        block = block.next();
+    }
+    cache.lineTokens.push_back(cache.tokens.size());
+
+    save_token_cache(cacheKey, cache);
 }
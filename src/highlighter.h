@@ -1,13 +1,19 @@
 #ifndef HIGHLIGHTER_H
 #define HIGHLIGHTER_H
 
+#include <QPixmapCache>
 #include <QSyntaxHighlighter>
 #include <QTextCharFormat>
 #include <QTimer>
 
+#include <map>
+
+#include "blockstore.h"
 #include "extension.h"
 #include "grammar.h"
+#include "styles.h"
 #include "theme.h"
+#include "tokenizer.h"
 
 struct span_info_t {
     int start;
@@ -17,21 +23,12 @@ struct span_info_t {
     int blue;
 };
 
-struct bracket_info_t {
-    size_t line;
-    size_t position;
-    int bracket;
-    bool open;
-    bool unpaired;
-};
-
 #define SCOPE_PROPERTY_ID 0x99
 
-enum {
-    SCOPE_UNSET = 0,
-    SCOPE_STRING = 1,
-    SCOPE_COMMENT = 2,
-    SCOPE_OTHER = 3,
+struct format_info_t {
+    bool apply;
+    QTextCharFormat format;
+    QColor color;
 };
 
 enum block_state_e {
@@ -40,29 +37,78 @@ enum block_state_e {
     BLOCK_STATE_BLOCK_NESTED = 1 << 3
 };
 
+// the interned parser state id lives above the block state flags
+#define BLOCK_STATE_SHIFT 4
+
 class HighlightBlockData : public QTextBlockUserData {
 public:
-    HighlightBlockData()
+    HighlightBlockData(block_store_ptr store)
         : QTextBlockUserData()
+        , store(store)
         , dirty(false)
         , folded(false)
-        , lastPrevBlockRule(0)
+        , foldable(false)
+        , tokenized(false)
+        , provisional(false)
+        , restored(false)
+        , style(0)
+        , bufferGeneration(0)
+        , revision(0)
+        , spansRevision(-1)
+        , state(0)
+        , signature(0)
+        , blockState(0)
+        , line(0)
+        , commentBegin(0)
+        , commentEnd(0)
+        , tokenRange({ 0, 0, 0 })
+        , bracketRange({ 0, 0, 0 })
+        , foldingRange({ 0, 0, 0 })
     {
     }
 
-    parse::stack_ptr parser_state;
+    ~HighlightBlockData()
+    {
+        store->releaseTokens(tokenRange);
+        store->releaseBrackets(bracketRange);
+        store->releaseBrackets(foldingRange);
+        QPixmapCache::remove(buffer);
+    }
+
+    token_view_t tokens() { return token_view_t(store.get(), tokenRange); }
+    bracket_view_t brackets() { return bracket_view_t(store.get(), bracketRange, line); }
+    bracket_view_t foldingBrackets() { return bracket_view_t(store.get(), foldingRange, line); }
+
+    block_store_ptr store;
 
     bool dirty;
     bool folded;
     bool foldable;
-    size_t lastPrevBlockRule;
-
+    bool tokenized;
+    bool provisional;
+    bool restored; // tokens came from the disk cache, formats are current
+    int style; // style generation the formats were built with
+    int state; // interned parser state at the end of the line
+    quint64 signature; // end state restored from the cache, while state is not known
+    int blockState;
+    int line;
+    int commentBegin;
+    int commentEnd;
+
+    block_range_t tokenRange;
+    block_range_t bracketRange;
+    block_range_t foldingRange;
+
+    // rendered line, in the global pixmap cache which may evict it any time
+    QPixmapCache::Key buffer;
+    int bufferGeneration;
+
+    // bumped whenever the block is highlighted
+    int revision;
+
+    // minimap spans, built from the tokens when first drawn after a highlight
     std::vector<span_info_t> spans;
-    std::vector<bracket_info_t> foldingBrackets;
-    std::vector<bracket_info_t> brackets;
-    std::map<size_t, scope::scope_t> scopes;
-
-    QPixmap buffer;
+    int spansRevision;
 };
 
 class Highlighter : public QSyntaxHighlighter {
@@ -74,13 +120,26 @@ public:
     void setTheme(theme_ptr theme);
     void setLanguage(language_info_ptr lang);
     void setDeferRendering(bool defer);
+    void setForeground(bool foreground);
 
     bool isDirty() { return hasDirtyBlocks; }
     bool isReady() { return !deferRendering; }
 
+    void setVisibleRange(int first, int last);
+    void setCacheFile(const QString& fileName);
+    bool restoreTokens();
+    void restyle();
+    const std::vector<span_info_t>& minimapSpans(QTextBlock& block);
+
+public slots:
+    void scheduleHighlight();
+
 protected:
     void highlightBlock(const QString& text) override;
-    void setFormatFromStyle(size_t start, size_t length, style_t& style, const char* line, HighlightBlockData* blockData, std::string scope);
+    void setFormatFromStyle(size_t start, size_t length, format_info_t* format);
+
+    format_info_t* formatForStyle(style_t& style, int kind);
+    format_info_t* formatForScope(int scope);
 
 private:
     bool deferRendering;
@@ -88,15 +147,89 @@ private:
     language_info_ptr lang;
     parse::grammar_ptr grammar;
     theme_ptr theme;
+    theme_styles_ptr styles;
+
+    // prebuilt formats, rebuilt on theme change
+    std::map<quint64, format_info_t> formatPool;
+    std::vector<format_info_t*> scopeFormats;
+    format_info_t* commentFormat;
 
     QColor foregroundColor;
 
     bool hasDirtyBlocks;
-    QTextBlock updateIterator;
     QTimer updateTimer;
 
+    //----------------------
+    // highlight scheduler
+    //----------------------
+    bool needsHighlight(QTextBlock& block);
+    bool tokenizeRange(int start, int end);
+
+    int visibleFirst;
+    int visibleLast;
+    int scrollDirection;
+    int sweepBlock;
+    int documentRevision;
+    int cascadeBlock;
+    int cascadeCount;
+
+    // shared with a tokenizer job that may outlive the highlighter
+    parser_state_pool_ptr statePool;
+    line_memo_ptr lineMemo;
+    block_store_ptr blockStore;
+
+    // reused from line to line
+    utf8_line_t lineBuffer;
+    std::vector<token_t> scratchTokens;
+    std::vector<bracket_match_t> scratchMatches;
+    std::vector<bracket_info_t> scratchBrackets;
+    std::vector<bracket_info_t> scratchFolding;
+
+    Tokenizer tokenizer;
+    int jobEnd;
+    int jobApplied;
+    bool jobChanged;
+    bool jobPending;
+    bool jobFinished;
+    bool jobExact;
+    size_t jobSize;
+    std::vector<tokenized_line_t> tokenizedLines;
+    size_t tokenizedIndex;
+    QTimer applyTimer;
+
+    //----------------------
+    // token cache
+    //----------------------
+    QString grammarKey();
+    void saveTokens();
+
+    QString cacheFile;
+    QByteArray cacheKey; // hash of the file's path
+    int cacheRevision;
+    bool cacheSaved;
+    int restoreBlock;
+    int restoreEnd;
+    QTimer restoreTimer;
+
+    //----------------------
+    // restyle
+    //----------------------
+    int restyleBlocks(int start, int end, int budget);
+
+    int styleGeneration;
+    bool restyling;
+    int restyleBlock;
+    QTimer restyleTimer;
+
+signals:
+    void highlightProgress();
+
 private Q_SLOTS:
-    void onUpdate();
+    void onTokenized();
+    void applyTokenized();
+    void restoreSlice();
+    void restyleSlice();
+    void onContentsChange(int position, int removed, int added);
 };
 
 #endif // HIGHLIGHTER_H
\ No newline at end of file
@@ -9,6 +9,8 @@
 
 #include "commands.h"
 #include "editor.h"
+#include "frameprobe.h"
+#include "grammarprofile.h"
 #include "js.h"
 #include "mainwindow.h"
 #include "process.h"
@@ -319,13 +321,13 @@ QList<int> JSApp::cursor()
 void JSApp::zoomIn()
 {
     editor()->editor->zoomIn();
-    // editor()->invalidateBuffers();
+    editor()->invalidateBuffers();
 }
 
 void JSApp::zoomOut()
 {
     editor()->editor->zoomOut();
-    // editor()->invalidateBuffers();
+    editor()->invalidateBuffers();
 }
 
 void JSApp::setCursor(int line, int position, bool select)
@@ -403,6 +405,53 @@ QString JSApp::language()
     return editor()->lang->id.c_str();
 }
 
+void JSApp::showFrameStats(bool show)
+{
+    FrameProbes::instance()->visible = show;
+    if (editor()) {
+        editor()->editor->paintToBuffer();
+    }
+}
+
+void JSApp::resetFrameStats()
+{
+    FrameProbes::instance()->reset();
+}
+
+QString JSApp::frameStats()
+{
+    Json::StreamWriterBuilder builder;
+    const std::string output = Json::writeString(builder, FrameProbes::instance()->toJson());
+    return output.c_str();
+}
+
+void JSApp::profileGrammars(bool enable)
+{
+    GrammarProfile::instance()->setEnabled(enable);
+}
+
+void JSApp::resetGrammarProfile()
+{
+    GrammarProfile::instance()->reset();
+}
+
+QString JSApp::grammarProfile()
+{
+    Json::StreamWriterBuilder builder;
+    const std::string output = Json::writeString(builder, GrammarProfile::instance()->toJson());
+    return output.c_str();
+}
+
+bool JSApp::saveGrammarProfile(QString path)
+{
+    QFile file(path);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+        return false;
+    }
+    file.write(grammarProfile().toUtf8());
+    return true;
+}
+
 void JSApp::runScriptFile(QString path)
 {
     MainWindow::instance()->js()->runScriptFile(path);
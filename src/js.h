@@ -90,6 +90,15 @@ public slots:
     QStringList scopesAtCursor();
     QString language();
 
+    void showFrameStats(bool show);
+    void resetFrameStats();
+    QString frameStats();
+
+    void profileGrammars(bool enable);
+    void resetGrammarProfile();
+    QString grammarProfile();
+    bool saveGrammarProfile(QString path);
+
     void loadExtensions();
     // void loadExtension(QString name);
     void runScriptFile(QString path);
@@ -0,0 +1,248 @@
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <cstring>
+
+#include "jsoncache.h"
+#include "reader.h"
+
+#define JSON_CACHE_MAGIC 0x414a534e
+#define JSON_CACHE_VERSION 2
+
+struct json_cache_header_t {
+    quint32 magic;
+    quint32 version;
+    qint64 mtime;
+    qint64 size;
+};
+
+static QString json_cache_path(const QString& path)
+{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::HomeLocation) + "/.ashlar/cache/json";
+    QDir().mkpath(dir);
+
+    QByteArray key = QCryptographicHash::hash(QFileInfo(path).absoluteFilePath().toUtf8(), QCryptographicHash::Sha1);
+    return dir + "/" + key.toHex() + ".bin";
+}
+
+//----------------------
+// encoding
+//----------------------
+template <typename T>
+static void write_raw(QByteArray& out, T value)
+{
+    out.append((const char*)&value, sizeof(T));
+}
+
+static void write_string(QByteArray& out, const std::string& s)
+{
+    write_raw<quint32>(out, s.length());
+    out.append(s.c_str(), s.length());
+}
+
+static void write_value(QByteArray& out, const Json::Value& value)
+{
+    write_raw<quint8>(out, value.type());
+    switch (value.type()) {
+    case Json::intValue:
+        write_raw<qint64>(out, value.asLargestInt());
+        break;
+    case Json::uintValue:
+        write_raw<quint64>(out, value.asLargestUInt());
+        break;
+    case Json::realValue:
+        write_raw<double>(out, value.asDouble());
+        break;
+    case Json::stringValue:
+        write_string(out, value.asString());
+        break;
+    case Json::booleanValue:
+        write_raw<quint8>(out, value.asBool());
+        break;
+    case Json::arrayValue:
+        write_raw<quint32>(out, value.size());
+        for (int i = 0; i < value.size(); i++) {
+            write_value(out, value[i]);
+        }
+        break;
+    case Json::objectValue: {
+        Json::Value::Members names = value.getMemberNames();
+        write_raw<quint32>(out, names.size());
+        for (auto& name : names) {
+            write_string(out, name);
+            write_value(out, value[name]);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+//----------------------
+// decoding
+//----------------------
+struct json_reader_t {
+    const uchar* p;
+    const uchar* end;
+
+    template <typename T>
+    bool read(T& value)
+    {
+        if (end - p < sizeof(T)) {
+            return false;
+        }
+        memcpy(&value, p, sizeof(T));
+        p += sizeof(T);
+        return true;
+    }
+
+    bool readString(std::string& s)
+    {
+        quint32 length;
+        if (!read(length) || end - p < length) {
+            return false;
+        }
+        s.assign((const char*)p, length);
+        p += length;
+        return true;
+    }
+
+    bool readValue(Json::Value& value)
+    {
+        quint8 type;
+        if (!read(type)) {
+            return false;
+        }
+
+        switch (type) {
+        case Json::nullValue:
+            value = Json::Value();
+            return true;
+        case Json::intValue: {
+            qint64 v;
+            if (!read(v)) {
+                return false;
+            }
+            value = Json::Value((Json::Value::Int64)v);
+            return true;
+        }
+        case Json::uintValue: {
+            quint64 v;
+            if (!read(v)) {
+                return false;
+            }
+            value = Json::Value((Json::Value::UInt64)v);
+            return true;
+        }
+        case Json::realValue: {
+            double v;
+            if (!read(v)) {
+                return false;
+            }
+            value = Json::Value(v);
+            return true;
+        }
+        case Json::stringValue: {
+            std::string s;
+            if (!readString(s)) {
+                return false;
+            }
+            value = Json::Value(s);
+            return true;
+        }
+        case Json::booleanValue: {
+            quint8 v;
+            if (!read(v)) {
+                return false;
+            }
+            value = Json::Value((bool)v);
+            return true;
+        }
+        case Json::arrayValue: {
+            quint32 n;
+            if (!read(n)) {
+                return false;
+            }
+            value = Json::Value(Json::arrayValue);
+            value.resize(n);
+            for (quint32 i = 0; i < n; i++) {
+                if (!readValue(value[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case Json::objectValue: {
+            quint32 n;
+            if (!read(n)) {
+                return false;
+            }
+            value = Json::Value(Json::objectValue);
+            std::string name;
+            for (quint32 i = 0; i < n; i++) {
+                if (!readString(name) || !readValue(value[name])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+};
+
+Json::Value load_json_cached(const QString& path)
+{
+    // the source is not read when the cache is current, its mtime and size
+    // stand in for its content
+    QFileInfo info(path);
+    if (!info.exists()) {
+        return Json::Value();
+    }
+
+    json_cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JSON_CACHE_MAGIC;
+    header.version = JSON_CACHE_VERSION;
+    header.mtime = info.lastModified().toMSecsSinceEpoch();
+    header.size = info.size();
+
+    QString cachePath = json_cache_path(path);
+
+    QFile cache(cachePath);
+    if (cache.open(QIODevice::ReadOnly) && cache.size() > sizeof(header)) {
+        const uchar* data = cache.map(0, cache.size());
+        if (data && memcmp(data, &header, sizeof(header)) == 0) {
+            json_reader_t reader = { data + sizeof(header), data + cache.size() };
+            Json::Value root;
+            if (reader.readValue(root)) {
+                return root;
+            }
+        }
+    }
+    cache.close();
+
+    Json::Value root = parse::loadJson(path.toStdString());
+    if (root.empty()) {
+        return root;
+    }
+
+    QByteArray out;
+    out.append((const char*)&header, sizeof(header));
+    write_value(out, root);
+
+    QSaveFile file(cachePath);
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(out);
+        file.commit();
+    }
+
+    return root;
+}
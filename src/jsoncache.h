@@ -0,0 +1,18 @@
+#ifndef JSONCACHE_H
+#define JSONCACHE_H
+
+#include <QString>
+
+#include "json/json.h"
+
+//----------------------
+// json cache
+//----------------------
+// large json files read at startup (grammars) are kept in a binary form
+// under ~/.ashlar/cache so that the next session maps and walks them
+// instead of parsing text. entries are checked against the source file's
+// mtime and size. compiled regexes live inside tm-parser and can not be
+// stored, a grammar is compiled once per session and shared by its editors
+Json::Value load_json_cached(const QString& path);
+
+#endif // JSONCACHE_H
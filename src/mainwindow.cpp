@@ -5,6 +5,8 @@
 #include <iostream>
 
 #include "commands.h"
+#include "frameprobe.h"
+#include "grammarprofile.h"
 #include "icons.h"
 #include "mainwindow.h"
 #include "reader.h"
@@ -205,6 +207,13 @@ void MainWindow::applySettings()
     editor_settings->debug_scopes = settings.isMember("debug_scopes") && settings["debug_scopes"] == true;
     editor_settings->smooth_scroll = settings.isMember("smooth_scroll") && settings["smooth_scroll"] == true;
 
+    // rendered lines for smooth scrolling, shared by all editors
+    int renderCacheSize = 64;
+    if (settings.isMember("render_cache_mb")) {
+        renderCacheSize = std::stoi(settings["render_cache_mb"].asString());
+    }
+    QPixmapCache::setCacheLimit(renderCacheSize * 1024);
+
     // qDebug() << editor_settings->word_wrap;
     // std::cout << settings << std::endl;
 
@@ -222,6 +231,18 @@ void MainWindow::applySettings()
         editor_settings->tab_size = 8;
     }
 
+    int tokenizerThreads = 0;
+    int tokenizerCpuShare = 50;
+    if (settings.isMember("tokenizer_threads")) {
+        tokenizerThreads = std::stoi(settings["tokenizer_threads"].asString());
+    }
+    if (settings.isMember("tokenizer_cpu_share")) {
+        tokenizerCpuShare = std::stoi(settings["tokenizer_cpu_share"].asString());
+    }
+    TokenizerPool::instance()->configure(tokenizerThreads, tokenizerCpuShare);
+    FrameProbes::instance()->visible = settings.isMember("frame_stats") && settings["frame_stats"] == true;
+    GrammarProfile::instance()->setEnabled(settings.isMember("grammar_profile") && settings["grammar_profile"] == true);
+
     if (settings.isMember("sidebar") && settings["sidebar"] == true) {
         QFont font;
         font.setFamily(editor_settings->font);
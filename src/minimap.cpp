@@ -7,6 +7,7 @@
 
 #include "Cubic.h"
 #include "editor.h"
+#include "frameprobe.h"
 #include "minimap.h"
 #include "tmedit.h"
 
@@ -17,7 +18,7 @@ MiniMap::MiniMap(QWidget* parent)
     connect(&animateTimer, SIGNAL(timeout()), this, SLOT(updateScroll()));
 }
 
-static int renderOneLine(QPainter& p, QTextBlock& block, int offsetY, float advanceY, int h = 1)
+static int renderOneLine(QPainter& p, Highlighter* highlighter, QTextBlock& block, int offsetY, float advanceY, int h = 1)
 {
     if (!block.isValid()) {
         return -1;
@@ -27,7 +28,7 @@ static int renderOneLine(QPainter& p, QTextBlock& block, int offsetY, float adva
     if (blockData) {
         int n = block.firstLineNumber();
         int y = n * advanceY;
-        for (auto span : blockData->spans) {
+        for (auto& span : highlighter->minimapSpans(block)) {
             int x = span.start;
             int w = span.length;
             p.setPen(QColor(span.red, span.green, span.blue));
@@ -45,6 +46,8 @@ static int renderOneLine(QPainter& p, QTextBlock& block, int offsetY, float adva
 
 void MiniMap::paintEvent(QPaintEvent* event)
 {
+    FrameProbe probe(PROBE_MINIMAP);
+
     float scaleX = 0.75;
     float advanceY = 2.0;
 
@@ -59,7 +62,7 @@ void MiniMap::paintEvent(QPaintEvent* event)
         QTextBlock block = cursor.block();
         
         pt.scale(scaleX, 1);
-        renderOneLine(pt, block, offsetY, advanceY, 2);
+        renderOneLine(pt, editor->highlighter, block, offsetY, advanceY, 2);
         return;
     }
 
@@ -125,7 +128,7 @@ void MiniMap::paintEvent(QPaintEvent* event)
     int idx = 0;
     QTextBlock block = doc->findBlockByNumber(start);
     while (block.isValid()) {
-        int y = renderOneLine(p, block, offsetY, advanceY);
+        int y = renderOneLine(p, editor->highlighter, block, offsetY, advanceY);
         if (y - offsetY > height()) {
             break;
         }
@@ -0,0 +1,133 @@
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <map>
+#include <unordered_map>
+
+#include "styles.h"
+
+static QMutex scopesMutex;
+static std::map<scope::scope_t, int> scopeIds;
+static std::unordered_map<std::string, int> scopeNameIds;
+static std::vector<std::string> scopeNames = { "" };
+static std::vector<int> scopeKinds = { SCOPE_OTHER };
+
+static int add_scope_name(std::string const& name)
+{
+    auto it = scopeNameIds.find(name);
+    if (it != scopeNameIds.end()) {
+        return it->second;
+    }
+
+    int kind = SCOPE_OTHER;
+    if (name.find("comment") != std::string::npos) {
+        kind = SCOPE_COMMENT;
+    } else if (name.find("string") != std::string::npos) {
+        kind = SCOPE_STRING;
+    }
+
+    int id = scopeNames.size();
+    scopeNameIds.emplace(name, id);
+    scopeNames.push_back(name);
+    scopeKinds.push_back(kind);
+    return id;
+}
+
+int scope_id(scope::scope_t const& scope)
+{
+    // ids never change once given out, so each tokenizer thread keeps its
+    // own copy of the ones it has seen and only locks for new scopes
+    thread_local std::map<scope::scope_t, int> seen;
+    auto sit = seen.find(scope);
+    if (sit != seen.end()) {
+        return sit->second;
+    }
+
+    QMutexLocker lock(&scopesMutex);
+    int id = 0;
+    auto it = scopeIds.find(scope);
+    if (it != scopeIds.end()) {
+        id = it->second;
+    } else {
+        std::string name = to_s(scope);
+        if (name.empty()) {
+            return 0;
+        }
+        id = add_scope_name(name);
+        scopeIds.emplace(scope, id);
+    }
+
+    seen.emplace(scope, id);
+    return id;
+}
+
+int scope_id_for_name(std::string const& name)
+{
+    if (name.empty()) {
+        return 0;
+    }
+
+    QMutexLocker lock(&scopesMutex);
+    return add_scope_name(name);
+}
+
+int scope_kind(int id)
+{
+    QMutexLocker lock(&scopesMutex);
+    if (id < 0 || id >= scopeKinds.size()) {
+        return SCOPE_OTHER;
+    }
+    return scopeKinds[id];
+}
+
+std::string scope_name(int id)
+{
+    QMutexLocker lock(&scopesMutex);
+    if (id < 0 || id >= scopeNames.size()) {
+        return "";
+    }
+    return scopeNames[id];
+}
+
+void theme_styles_t::resolve(int id)
+{
+    if (id >= kinds.size()) {
+        styles.resize(id + 1);
+        kinds.resize(id + 1, SCOPE_UNSET);
+    }
+
+    if (kinds[id] == SCOPE_UNSET) {
+        styles[id] = theme->styles_for_scope(scope_name(id));
+        kinds[id] = scope_kind(id);
+    }
+}
+
+style_t& theme_styles_t::style(int id)
+{
+    resolve(id);
+    return styles[id];
+}
+
+int theme_styles_t::kind(int id)
+{
+    resolve(id);
+    return kinds[id];
+}
+
+theme_styles_ptr theme_styles(theme_ptr theme)
+{
+    static std::map<const void*, std::weak_ptr<theme_styles_t>> cache;
+
+    auto it = cache.find(theme.get());
+    if (it != cache.end()) {
+        theme_styles_ptr styles = it->second.lock();
+        if (styles && styles->theme == theme) {
+            return styles;
+        }
+    }
+
+    theme_styles_ptr styles = std::make_shared<theme_styles_t>();
+    styles->theme = theme;
+    cache[theme.get()] = styles;
+    return styles;
+}
@@ -0,0 +1,50 @@
+#ifndef STYLES_H
+#define STYLES_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "grammar.h"
+#include "theme.h"
+
+enum {
+    SCOPE_UNSET = 0,
+    SCOPE_STRING = 1,
+    SCOPE_COMMENT = 2,
+    SCOPE_OTHER = 3,
+};
+
+//----------------------
+// scope ids
+//----------------------
+// scopes are interned once (from any thread) and passed around as ids.
+// id 0 is the empty scope
+int scope_id(scope::scope_t const& scope);
+int scope_id_for_name(std::string const& name);
+int scope_kind(int id);
+std::string scope_name(int id);
+
+//----------------------
+// theme styles
+//----------------------
+// resolving a style runs the theme selectors against the scope, do it
+// once per scope id and share the result among all highlighters
+struct theme_styles_t {
+    theme_ptr theme;
+
+    style_t& style(int id);
+    int kind(int id);
+
+private:
+    void resolve(int id);
+
+    std::vector<style_t> styles;
+    std::vector<int> kinds;
+};
+
+typedef std::shared_ptr<theme_styles_t> theme_styles_ptr;
+
+theme_styles_ptr theme_styles(theme_ptr theme);
+
+#endif // STYLES_H
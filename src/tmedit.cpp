@@ -1,7 +1,11 @@
 #include <QtWidgets>
 
+#include <cmath>
+#include <unordered_map>
+
 #include "commands.h"
 #include "editor.h"
+#include "frameprobe.h"
 #include "gutter.h"
 #include "mainwindow.h"
 #include "minimap.h"
@@ -14,6 +18,15 @@
 #define SMOOTH_SCROLL_FRICTION_Y 0.8
 #define SMOOTH_SCROLL_X 8
 
+// the pages around the viewport are rendered after this long without input (ms)
+#define PRERENDER_IDLE 150
+// and in slices of about this long (ms)
+#define PRERENDER_BUDGET 4
+
+// unwrapped lines longer than this are only drawn around the visible columns
+#define LONG_LINE_COLUMNS 1000
+#define LONG_LINE_MARGIN 64
+
 //---------------------
 // overlay
 //---------------------
@@ -30,61 +43,85 @@ Overlay::Overlay(QWidget* parent)
 
 void Overlay::updateCursor()
 {
-
+    // only the focused editor blinks, an idle one repaints just its carets
     TextmateEdit* editor = qobject_cast<TextmateEdit*>(QApplication::focusWidget());
-    if (!editor) {
-        cursorOn = false;
+    bool on = editor == parent() && !cursorOn;
+    if (on == cursorOn) {
         return;
     }
 
-    cursorOn = !cursorOn;
-    update();
+    cursorOn = on;
+    updateCursorRects();
 }
 
-void Overlay::paintEvent(QPaintEvent*)
+void Overlay::showCursor()
 {
-    // this actually draws the QPlainTextEdit widget .. with some extras
-    QWidget* container = (QWidget*)parent();
-    resize(container->width(), container->height());
-
-    QPainter p(this);
-    p.drawPixmap(rect(), buffer, buffer.rect());
-
+    updateTimer.start(750);
     if (!cursorOn) {
+        cursorOn = true;
+        updateCursorRects();
+    }
+}
+
+void Overlay::setCursorRects(QVector<QRect>& rects)
+{
+    if (rects == cursorRects) {
         return;
     }
 
-    TextmateEdit* editor = (TextmateEdit*)parent();
-    Editor* e = (Editor*)editor->parent();
+    updateCursorRects();
+    cursorRects = rects;
+    updateCursorRects();
+}
 
-    p.translate(0, editor->offset().y());
+void Overlay::updateCursorRects()
+{
+    for (auto& r : cursorRects) {
+        update(r);
+    }
+}
 
-    QList<QTextCursor> cursors;
-    cursors << editor->extraCursors;
-    cursors << editor->textCursor();
+void Overlay::paintEvent(QPaintEvent* event)
+{
+    FrameProbe probe(PROBE_OVERLAY);
 
-    QTextBlock block = editor->_firstVisibleBlock();
-    while (block.isValid()) {
-        QRectF rect = editor->_blockBoundingGeometry(block).translated(editor->_contentOffset());
-        if (rect.top() > height())
-            break;
+    // this actually draws the QPlainTextEdit widget .. with some extras
+    QWidget* container = (QWidget*)parent();
+    resize(container->width(), container->height());
 
-        if (block.isVisible()) {
+    // the text layer is only copied where it was damaged
+    QRect dirty = event->rect();
+    QPainter p(this);
+    p.drawPixmap(dirty, buffer, dirty);
+
+    FrameProbes* probes = FrameProbes::instance();
+    if (probes->visible) {
+        QFont font = container->font();
+        font.setPointSize(std::max(8, font.pointSize() - 2));
+        p.setFont(font);
+
+        // sorts every probe's samples, once per paint
+        QString summary = probes->summary();
+        QRect box = p.fontMetrics().boundingRect(QRect(0, 0, width(), height()), Qt::AlignLeft | Qt::TextExpandTabs, summary);
+        box.moveTopRight(QPoint(width() - 8, 8));
+        p.fillRect(box.adjusted(-6, -4, 6, 4), QColor(0, 0, 0, 160));
+        p.setPen(Qt::white);
+        p.drawText(box, Qt::AlignLeft, summary);
+    }
 
-            QTextLayout* layout = block.layout();
+    if (!cursorOn) {
+        return;
+    }
 
-            //-----------------
-            // cursors
-            //-----------------
-            if (cursorOn) {
-                for (auto cursor : cursors) {
-                    if (cursor.block() == block) {
-                        layout->drawCursor(&p, rect.topLeft(), cursor.position() - block.position());
-                    }
-                }
-            }
+    //-----------------
+    // cursors
+    //-----------------
+    // caret rects are worked out by paintToBuffer, painting them is a fill
+    QBrush caret = palette().brush(foregroundRole());
+    for (auto& r : cursorRects) {
+        if (r.intersects(dirty)) {
+            p.fillRect(r, caret);
         }
-        block = block.next();
     }
 }
 
@@ -100,6 +137,7 @@ void Overlay::mousePressEvent(QMouseEvent* event)
 TextmateEdit::TextmateEdit(QWidget* parent)
     : QPlainTextEdit(parent)
     , updateTimer(this)
+    , paintedFrame(0)
     , _offset(QPointF(0, 0))
 {
     overlay = new Overlay(this);
@@ -117,6 +155,9 @@ TextmateEdit::TextmateEdit(QWidget* parent)
         this, &TextmateEdit::insertCompletion);
 
     connect(&updateTimer, SIGNAL(timeout()), this, SLOT(updateScrollDelta()));
+
+    prerenderTimer.setSingleShot(true);
+    connect(&prerenderTimer, SIGNAL(timeout()), this, SLOT(prerender()));
 }
 
 void TextmateEdit::contextMenuEvent(QContextMenuEvent* event)
@@ -128,19 +169,17 @@ void TextmateEdit::contextMenuEvent(QContextMenuEvent* event)
     // delete menu;
 }
 
-void TextmateEdit::paintToBuffer()
+static uint combine_hash(uint hash, uint value)
 {
-    // paint to buffer
-    QPixmap map(width(), height());
-    // map.fill(Qt::transparent);
+    return hash * 31 + value;
+}
 
-    QPainter p(&map);
-    if (scrollVelocity.x() == 0 && scrollVelocity.y() == 0)
-        p.setRenderHint(QPainter::Antialiasing);
+void TextmateEdit::paintToBuffer()
+{
+    FrameProbe probe(PROBE_PAINT);
 
     TextmateEdit* editor = this;
     Editor* e = (Editor*)editor->parent();
-    p.fillRect(rect(), e->backgroundColor);
 
     QColor selectionBg = e->selectionBgColor;
     QColor foldedBg = selectionBg;
@@ -163,9 +202,9 @@ void TextmateEdit::paintToBuffer()
     }
 
     float x = 0;
-    float y = fh * scrollDelta.y() / SMOOTH_SCROLL_THRESHOLD_Y;
+    // whole pixels, so that a shifted frame lines up with freshly painted blocks
+    float y = round(fh * scrollDelta.y() / SMOOTH_SCROLL_THRESHOLD_Y);
     _offset = QPointF(x, y);
-    p.translate(x, y);
 
     if (x != 0 && y != 0) {
         overlay->cursorOn = false;
@@ -195,77 +234,256 @@ void TextmateEdit::paintToBuffer()
     }
 
     //-----------------
-    // selections
+    // visible blocks
     //-----------------
-    for (auto cursor : cursors) {
-        if (!cursor.hasSelection()) {
-            continue;
+    // selections are clipped to these up front, so that the cost of a
+    // frame does not depend on how much is selected or how many cursors
+    std::vector<QTextBlock> visibleBlocks;
+    block = firstVisibleBlock();
+    if (block.previous().isValid()) {
+        block = block.previous();
+    }
+    while (block.isValid()) {
+        QRectF r = blockBoundingGeometry(block).translated(contentOffset());
+        if (r.top() > height() + 20) {
+            break;
         }
+        visibleBlocks.push_back(block);
+        block = block.next();
+    }
 
-        QTextCursor cs(cursor);
-        cs.setPosition(cs.selectionStart());
+    QList<QTextCursor> selections;
+    if (visibleBlocks.size()) {
+        int visibleStart = visibleBlocks.front().position();
+        int visibleEnd = visibleBlocks.back().position() + visibleBlocks.back().length();
+        for (auto cursor : cursors) {
+            if (cursor.hasSelection() && cursor.selectionEnd() >= visibleStart && cursor.selectionStart() <= visibleEnd) {
+                selections << cursor;
+            }
+        }
+    }
 
-        while (cs.position() < cursor.selectionEnd()) {
-            QTextBlock block = cs.block();
-            QRectF r = editor->_blockBoundingGeometry(block).translated(editor->_contentOffset());
-            if (r.top() > height() + 20) {
-                break;
+    //-----------------
+    // carets
+    //-----------------
+    QVector<QRect> carets;
+    if (visibleBlocks.size()) {
+        int visibleStart = visibleBlocks.front().position();
+        int visibleEnd = visibleBlocks.back().position() + visibleBlocks.back().length();
+
+        QList<QTextCursor> caretCursors;
+        for (auto cursor : extraCursors) {
+            if (cursor.position() >= visibleStart && cursor.position() < visibleEnd) {
+                caretCursors << cursor;
             }
+        }
+        caretCursors << textCursor();
 
-            if (block.isVisible()) {
-                QTextLayout* layout = block.layout();
+        for (auto& block : visibleBlocks) {
+            if (!block.isVisible()) {
+                continue;
+            }
+            QRectF r = blockBoundingGeometry(block).translated(contentOffset()).translated(x, y);
+            QTextLayout* layout = block.layout();
+            for (auto& cursor : caretCursors) {
+                if (cursor.block() != block) {
+                    continue;
+                }
+                int pos = cursor.position() - block.position();
+                QTextLine line = layout->lineForTextPosition(pos);
+                if (!line.isValid()) {
+                    continue;
+                }
+                qreal cx = line.cursorToX(pos);
+                carets << QRectF(r.left() + cx, r.top() + line.y(), cursorWidth(), line.height()).toAlignedRect();
+            }
+        }
+    }
+    overlay->setCursorRects(carets);
 
-                for (int i = 0; i < layout->lineCount(); i++) {
-                    QTextLine line = layout->lineAt(i);
-                    QColor selectionColor = e->selectionBgColor;
+    //-----------------
+    // damage
+    //-----------------
+    // each visible block gets a signature of everything that goes into
+    // drawing it. only blocks whose signature changed since the last frame
+    // are painted again, over the previous frame. blocks are matched to the
+    // last frame by identity, not number, which shifts on an insert or
+    // delete above. the previous frame is first shifted by how far its
+    // blocks moved
+    bool scrolling = scrollVelocity.x() != 0 || scrollVelocity.y() != 0;
+
+    uint frame = 0;
+    frame = combine_hash(frame, scrolling);
+    frame = combine_hash(frame, e->backgroundColor.rgba());
+    frame = combine_hash(frame, selectionBg.rgba());
+    frame = combine_hash(frame, e->renderGeneration);
+    frame = combine_hash(frame, e->settings->smooth_scroll);
+    frame = combine_hash(frame, FrameProbes::instance()->visible);
+
+    bool fullRepaint = overlay->buffer.size() != size() || frame != paintedFrame || paintedBlocks.empty();
+
+    std::vector<painted_block_t> painted;
+    QRegion damage;
+
+    for (auto& block : visibleBlocks) {
+        QRectF r = blockBoundingGeometry(block).translated(contentOffset());
+        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
 
-                    int sx = line.textStart();
-                    if (sx + block.position() < cursor.selectionStart()) {
-                        sx = cursor.selectionStart() - block.position();
-                    }
+        uint signature = 0;
+        signature = combine_hash(signature, block.revision());
+        // long lines go by length, hashing them every frame costs more than
+        // painting them
+        signature = combine_hash(signature, block.length() > LONG_LINE_COLUMNS ? block.length() : qHash(block.text()));
+        signature = combine_hash(signature, qHash(r.left()));
+        signature = combine_hash(signature, qHash(r.height()));
+        signature = combine_hash(signature, block.isVisible());
+        if (blockData) {
+            signature = combine_hash(signature, blockData->revision);
+            signature = combine_hash(signature, blockData->folded);
+        }
 
-                    int ex = sx + line.textLength();
-                    if (ex + block.position() > cursor.selectionEnd()) {
-                        ex = cursor.selectionEnd() - block.position();
-                    }
+        int blockStart = block.position();
+        int blockEnd = blockStart + block.length();
+        for (auto& cursor : selections) {
+            if (cursor.selectionEnd() < blockStart || cursor.selectionStart() > blockEnd) {
+                continue;
+            }
+            signature = combine_hash(signature, std::max(cursor.selectionStart(), blockStart) - blockStart);
+            signature = combine_hash(signature, std::min(cursor.selectionEnd(), blockEnd) - blockStart);
+            signature = combine_hash(signature, pairs.contains(cursor));
+        }
 
-                    qreal srx = line.cursorToX(&sx);
-                    qreal erx = line.cursorToX(&ex);
-                    float w = erx - srx;
-                    float h = fh;
-                    float offsetY = 0;
+        painted.push_back({ .id = blockData ? (quintptr)blockData : (quintptr)block.fragmentIndex(),
+            .number = block.blockNumber(),
+            .top = (int)floor(r.top() + y),
+            .bottom = (int)ceil(r.bottom() + y),
+            .signature = signature });
+    }
 
-                    if (pairs.contains(cursor)) {
-                        offsetY = h - 1;
-                        h = 2;
-                    }
+    //-----------------
+    // blit scroll
+    //-----------------
+    std::unordered_map<quintptr, painted_block_t*> previous;
+    for (auto& b : paintedBlocks) {
+        previous[b.id] = &b;
+    }
 
-                    r.setWidth(w);
-                    p.fillRect(QRect(r.left() + srx, r.top() + (i * fh) + offsetY, w, h), selectionColor);
-                }
+    int dy = 0;
+    if (!fullRepaint) {
+        // how far the blocks of the last frame moved
+        bool found = false;
+        for (auto& b : painted) {
+            auto it = previous.find(b.id);
+            if (it != previous.end()) {
+                dy = b.top - it->second->top;
+                found = true;
+                break;
             }
+        }
 
-            if (!cs.movePosition(QTextCursor::Down)) {
-                break;
+        if (!found || abs(dy) >= height()) {
+            fullRepaint = true;
+        } else if (dy != 0) {
+            overlay->buffer.scroll(0, dy, overlay->buffer.rect());
+            if (dy > 0) {
+                damage += QRect(0, 0, width(), dy);
+            } else {
+                damage += QRect(0, height() + dy, width(), -dy);
             }
-            cs.movePosition(QTextCursor::StartOfLine);
         }
     }
 
-    block = firstVisibleBlock();
-    if (block.previous().isValid()) {
-        block = block.previous();
+    if (!fullRepaint) {
+        for (auto& b : painted) {
+            auto it = previous.find(b.id);
+            bool same = it != previous.end();
+            if (same) {
+                painted_block_t& prev = *it->second;
+                same = prev.signature == b.signature && prev.top + dy == b.top && prev.bottom + dy == b.bottom;
+            }
+            if (!same) {
+                damage += QRect(0, b.top, width(), b.bottom - b.top + 1);
+            }
+        }
+
+        // the document got shorter or longer below the last block
+        int bottom = painted.size() ? painted.back().bottom : 0;
+        if (bottom != paintedBlocks.back().bottom + dy && bottom < height()) {
+            damage += QRect(0, bottom, width(), height() - bottom);
+        }
     }
-    while (block.isValid()) {
+
+    paintedBlocks.swap(painted);
+    paintedFrame = frame;
+
+    if (fullRepaint) {
+        overlay->buffer = QPixmap(width(), height());
+        damage = QRegion(rect());
+    }
+
+    if (!scrolling) {
+        prerenderTimer.start(PRERENDER_IDLE);
+    }
+
+    damage &= QRegion(rect());
+    if (damage.isEmpty()) {
+        return;
+    }
+
+    //-----------------
+    // paint the damage
+    //-----------------
+    QPainter p(&overlay->buffer);
+    p.setClipRegion(damage);
+    if (!scrolling)
+        p.setRenderHint(QPainter::Antialiasing);
+
+    p.fillRect(rect(), e->backgroundColor);
+    p.translate(x, y);
+
+    for (auto& block : visibleBlocks) {
         QRectF r = blockBoundingGeometry(block).translated(contentOffset());
-        if (r.top() > height() + 20) {
-            break;
+        if (!block.isVisible() || !damage.intersects(r.translated(x, y).toAlignedRect())) {
+            continue;
         }
 
-        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
-        if (blockData && block.isVisible()) {
-            QTextLayout* layout = block.layout();
+        //-----------------
+        // selections
+        //-----------------
+        QTextLayout* layout = block.layout();
+        int blockStart = block.position();
+        int blockEnd = blockStart + block.length();
+        for (auto& cursor : selections) {
+            if (cursor.selectionEnd() < blockStart || cursor.selectionStart() > blockEnd) {
+                continue;
+            }
+
+            for (int i = 0; i < layout->lineCount(); i++) {
+                QTextLine line = layout->lineAt(i);
+
+                int sx = std::max(line.textStart(), cursor.selectionStart() - blockStart);
+                int ex = std::min(line.textStart() + line.textLength(), cursor.selectionEnd() - blockStart);
+                if (ex < sx) {
+                    continue;
+                }
+
+                qreal srx = line.cursorToX(&sx);
+                qreal erx = line.cursorToX(&ex);
+                float w = erx - srx;
+                float h = fh;
+                float offsetY = 0;
 
+                if (pairs.contains(cursor)) {
+                    offsetY = h - 1;
+                    h = 2;
+                }
+
+                p.fillRect(QRect(r.left() + srx, r.top() + line.y() + offsetY, w, h), selectionBg);
+            }
+        }
+
+        HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+        if (blockData) {
             //-----------------
             // folded indicator
             //-----------------
@@ -276,25 +494,169 @@ void TextmateEdit::paintToBuffer()
             //-----------------
             // render the block
             //-----------------
-            if (e->settings->smooth_scroll) {
-                if (blockData->buffer.width() != r.width() || blockData->buffer.height() != r.height()) {
-                    blockData->buffer = QPixmap(r.width(), r.height());
-                    blockData->buffer.fill(Qt::transparent);
-                    QPainter pp(&blockData->buffer);
-                    pp.setRenderHint(QPainter::Antialiasing);
-                    layout->draw(&pp, QPointF(0, 0), QVector<QTextLayout::FormatRange>(), rect());
-                }
-                p.drawPixmap(r.left(), r.top(), blockData->buffer, 0, 0, r.width(), r.height());
+            if (isLongLine(block)) {
+                drawLongLine(p, block, r);
+            } else if (e->settings->smooth_scroll) {
+                QPixmap buffer;
+                renderBlock(block, blockData, r.size(), buffer);
+                p.drawPixmap(r.left(), r.top(), buffer, 0, 0, r.width(), r.height());
             } else {
                 layout->draw(&p, r.topLeft(), QVector<QTextLayout::FormatRange>(), rect());
             }
         }
+    }
 
-        block = block.next();
+    p.end();
+    if (FrameProbes::instance()->visible) {
+        overlay->update();
+    } else {
+        overlay->update(damage);
+    }
+}
+
+bool TextmateEdit::renderBlock(QTextBlock& block, HighlightBlockData* blockData, QSizeF size, QPixmap& buffer)
+{
+    Editor* e = (Editor*)parent();
+    if (blockData->bufferGeneration == e->renderGeneration && QPixmapCache::find(blockData->buffer, &buffer) && buffer.width() == (int)size.width() && buffer.height() == (int)size.height()) {
+        return false;
+    }
+
+    buffer = QPixmap(size.width(), size.height());
+    buffer.fill(Qt::transparent);
+    QPainter pp(&buffer);
+    pp.setRenderHint(QPainter::Antialiasing);
+    block.layout()->draw(&pp, QPointF(0, 0), QVector<QTextLayout::FormatRange>(), rect());
+    pp.end();
+
+    QPixmapCache::remove(blockData->buffer);
+    blockData->buffer = QPixmapCache::insert(buffer);
+    blockData->bufferGeneration = e->renderGeneration;
+    return true;
+}
+
+//-----------------
+// long lines
+//-----------------
+// the document layout still lays out the whole line, so cursor to x
+// mapping and selections stay exact. drawing goes through a small layout
+// of the visible columns, placed where the full line has them
+bool TextmateEdit::isLongLine(QTextBlock& block)
+{
+    return lineWrapMode() == QPlainTextEdit::NoWrap && block.length() > LONG_LINE_COLUMNS;
+}
+
+void TextmateEdit::drawLongLine(QPainter& p, QTextBlock& block, QRectF r)
+{
+    QTextLayout* layout = block.layout();
+    QTextLine line = layout->lineAt(0);
+    if (!line.isValid()) {
+        return;
+    }
+
+    qreal left = -r.left();
+    int start = std::max(0, line.xToCursor(left) - LONG_LINE_MARGIN);
+    int end = std::min(block.length() - 1, line.xToCursor(left + width()) + LONG_LINE_MARGIN);
+    if (end <= start) {
+        return;
+    }
+
+    QVector<QTextLayout::FormatRange> formats;
+    for (auto& f : layout->formats()) {
+        int fs = std::max(f.start, start);
+        int fe = std::min(f.start + f.length, end);
+        if (fe <= fs) {
+            continue;
+        }
+        QTextLayout::FormatRange range = f;
+        range.start = fs - start;
+        range.length = fe - fs;
+        formats << range;
+    }
+
+    // tab stops are measured from the start of a layout, the window's are
+    // moved to where the stops of the full line fall
+    qreal x = line.cursorToX(start);
+    qreal windowWidth = line.cursorToX(end) - x;
+    QTextOption option = layout->textOption();
+    QList<QTextOption::Tab> tabs;
+    for (auto& t : option.tabs()) {
+        if (t.position > x) {
+            tabs << QTextOption::Tab(t.position - x, t.type, t.delimiter);
+        }
+    }
+    qreal distance = option.tabStopDistance();
+    if (option.tabs().isEmpty() && distance > 0) {
+        for (qreal stop = (floor(x / distance) + 1) * distance; stop - x <= windowWidth + distance; stop += distance) {
+            tabs << QTextOption::Tab(stop - x, QTextOption::LeftTab);
+        }
+    }
+    option.setTabs(tabs);
+
+    QTextLayout window(block.text().mid(start, end - start), document()->defaultFont());
+    window.setTextOption(option);
+    window.setFormats(formats);
+    window.beginLayout();
+    QTextLine windowLine = window.createLine();
+    windowLine.setNumColumns(end - start);
+    windowLine.setPosition(QPointF(0, line.y()));
+    window.endLayout();
+
+    window.draw(&p, QPointF(r.left() + x, r.top()));
+}
+
+//-----------------
+// pre-render
+//-----------------
+// while idle, lay out and render the page below and the page above the
+// viewport into the block cache, so that paging finds them ready. any
+// input stops it, the next frame starts the idle wait over
+void TextmateEdit::prerender()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    Editor* e = (Editor*)parent();
+
+    QTextBlock first = firstVisibleBlock();
+    QTextBlock last = first;
+    int page = 0;
+    while (last.isValid() && blockBoundingGeometry(last).translated(contentOffset()).top() < height()) {
+        last = last.next();
+        page++;
+    }
+    if (!first.isValid() || !page) {
+        return;
     }
 
-    overlay->buffer = map;
-    overlay->update();
+    int firstNumber = first.blockNumber();
+    int lastNumber = firstNumber + page - 1;
+    std::vector<std::pair<int, int>> ranges = {
+        { lastNumber + 1, lastNumber + page },
+        { firstNumber - page, firstNumber - 1 }
+    };
+
+    for (auto& range : ranges) {
+        QTextBlock block = document()->findBlockByNumber(std::max(0, range.first));
+        while (block.isValid() && block.blockNumber() <= range.second) {
+            HighlightBlockData* blockData = reinterpret_cast<HighlightBlockData*>(block.userData());
+
+            // not highlighted yet, the highlighter gets to it first
+            if (blockData && !blockData->dirty && !blockData->provisional && block.isVisible() && !isLongLine(block)) {
+                // lays the block out if it is not yet
+                QRectF r = blockBoundingRect(block);
+                if (e->settings->smooth_scroll) {
+                    QPixmap buffer;
+                    renderBlock(block, blockData, r.size(), buffer);
+                }
+            }
+            block = block.next();
+
+            if (timer.elapsed() > PRERENDER_BUDGET) {
+                prerenderTimer.start(0);
+                return;
+            }
+        }
+    }
 }
 
 void TextmateEdit::paintEvent(QPaintEvent* e)
@@ -306,6 +668,8 @@ void TextmateEdit::paintEvent(QPaintEvent* e)
 
 void TextmateEdit::mousePressEvent(QMouseEvent* e)
 {
+    prerenderTimer.stop();
+
     if (e->modifiers() == Qt::ControlModifier) {
         addExtraCursor();
     } else {
@@ -393,6 +757,8 @@ bool TextmateEdit::completerKeyPressEvent(QKeyEvent* e)
 
 void TextmateEdit::keyPressEvent(QKeyEvent* e)
 {
+    prerenderTimer.stop();
+
     bool handledForMainCursor = false;
     bool noModifierExceptShift = (e->modifiers() == Qt::NoModifier || e->modifiers() & Qt::ShiftModifier);
     bool isNewline = (!(e->modifiers() & Qt::ControlModifier) && (e->key() == Qt::Key_Enter || e->key() == Qt::Key_Enter - 1));
@@ -476,13 +842,14 @@ void TextmateEdit::keyPressEvent(QKeyEvent* e)
         }
     }
 
-    overlay->cursorOn = true;
-    overlay->update();
+    overlay->showCursor();
     paintToBuffer();
 }
 
 void TextmateEdit::wheelEvent(QWheelEvent* e)
 {
+    prerenderTimer.stop();
+
     if (!editor->settings->smooth_scroll) {
         QPlainTextEdit::wheelEvent(e);
         return;
@@ -713,8 +1080,7 @@ void TextmateEdit::updateExtraCursors(QKeyEvent* e)
     }
 
     if (redraw) {
-        overlay->cursorOn = true;
-        overlay->update();
+        overlay->showCursor();
         return;
     }
 
@@ -750,5 +1116,5 @@ void TextmateEdit::addExtraCursor(QTextCursor cursor)
 void TextmateEdit::removeExtraCursors()
 {
     extraCursors.clear();
-    overlay->update();
+    paintToBuffer();
 }
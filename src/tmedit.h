@@ -3,27 +3,46 @@
 
 #include <QCompleter>
 #include <QFileSystemWatcher>
+#include <QPainter>
 #include <QPlainTextEdit>
 #include <QTextBlock>
 #include <QTextCursor>
 #include <QTimer>
 #include <QWidget>
 
+#include <vector>
+
 class Editor;
+class HighlightBlockData;
+
+struct painted_block_t {
+    quintptr id; // the block's data, or its fragment when it has none
+    int number;
+    int top;
+    int bottom;
+    uint signature;
+};
 
 class Overlay : public QWidget {
     Q_OBJECT
 public:
     Overlay(QWidget* parent = nullptr);
 
-    void paintEvent(QPaintEvent*) override;
+    void paintEvent(QPaintEvent* event) override;
     void mousePressEvent(QMouseEvent* event) override;
 
-    QPixmap buffer;
+    void showCursor();
+    void setCursorRects(QVector<QRect>& rects);
+
+    QPixmap buffer; // the text layer, carets are drawn over it
+    QVector<QRect> cursorRects;
 
     QTimer updateTimer;
     bool cursorOn;
 
+private:
+    void updateCursorRects();
+
 private Q_SLOTS:
     void updateCursor();
 };
@@ -53,6 +72,9 @@ public:
 
 private:
     bool completerKeyPressEvent(QKeyEvent* e);
+    bool renderBlock(QTextBlock& block, HighlightBlockData* blockData, QSizeF size, QPixmap& buffer);
+    bool isLongLine(QTextBlock& block);
+    void drawLongLine(QPainter& p, QTextBlock& block, QRectF r);
     void paintEvent(QPaintEvent* e) override;
     void mousePressEvent(QMouseEvent* event) override;
     void keyPressEvent(QKeyEvent* e) override;
@@ -62,15 +84,21 @@ private:
     Overlay* overlay;
     Editor* editor;
 
+    // what the last frame was painted from
+    std::vector<painted_block_t> paintedBlocks;
+    uint paintedFrame;
+
     QPointF _offset;
     QPointF scrollDelta;
     QPointF scrollVelocity;
     QTimer updateTimer;
+    QTimer prerenderTimer;
 
     QCompleter* completer;
 
 private Q_SLOTS:
     void updateScrollDelta();
+    void prerender();
     void insertCompletion(const QString& completion);
 };
 
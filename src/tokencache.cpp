@@ -0,0 +1,161 @@
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include "tokencache.h"
+
+#define TOKEN_CACHE_MAGIC 0x41544b43
+#define TOKEN_CACHE_VERSION 3
+
+// cache files kept, the least recently written go first
+#define TOKEN_CACHE_MAX_FILES 64
+
+struct cached_token_t {
+    uint32_t start;
+    uint32_t length;
+    uint32_t scope;
+};
+
+static QString token_cache_dir()
+{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::HomeLocation) + "/.ashlar/cache/tokens";
+    QDir().mkpath(dir);
+    return dir;
+}
+
+static QString token_cache_path(const QByteArray& key)
+{
+    return token_cache_dir() + "/" + key.toHex() + ".cache";
+}
+
+static void prune_token_cache()
+{
+    QDir dir(token_cache_dir());
+    QFileInfoList files = dir.entryInfoList(QStringList() << "*.cache", QDir::Files, QDir::Time);
+    for (int i = TOKEN_CACHE_MAX_FILES; i < files.size(); i++) {
+        QFile::remove(files[i].absoluteFilePath());
+    }
+}
+
+QByteArray token_cache_key(const QString& path)
+{
+    return QCryptographicHash::hash(QFileInfo(path).absoluteFilePath().toUtf8(), QCryptographicHash::Sha1);
+}
+
+bool load_token_cache(const QByteArray& key, token_cache_t& cache)
+{
+    QFile file(token_cache_path(key));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream in(&file);
+    quint32 magic, version;
+    in >> magic >> version;
+    if (magic != TOKEN_CACHE_MAGIC || version != TOKEN_CACHE_VERSION) {
+        return false;
+    }
+
+    QString grammar;
+    quint32 lines, tokens, scopes, states;
+    in >> grammar >> lines >> tokens >> scopes >> states;
+    if (in.status() != QDataStream::Ok || grammar != cache.grammar) {
+        return false;
+    }
+
+    // counts come from the file, check them against what is left of it
+    // before allocating anything. each name takes at least its length
+    if (scopes > (file.size() - file.pos()) / sizeof(quint32)) {
+        return false;
+    }
+
+    cache.scopeNames.clear();
+    for (int i = 0; i < scopes; i++) {
+        QByteArray name;
+        in >> name;
+        if (in.status() != QDataStream::Ok) {
+            return false;
+        }
+        cache.scopeNames.push_back(name.toStdString());
+    }
+
+    quint64 remaining = file.size() - file.pos();
+    quint64 needed = (quint64)lines * (sizeof(uint) + sizeof(uint32_t)) + (quint64)states * sizeof(quint64) + ((quint64)lines + 1) * sizeof(uint32_t) + (quint64)tokens * sizeof(cached_token_t);
+    if (needed != remaining) {
+        return false;
+    }
+
+    cache.lineHashes.resize(lines);
+    cache.lineStates.resize(lines);
+    cache.states.resize(states);
+    cache.lineTokens.resize(lines + 1);
+    std::vector<cached_token_t> packed(tokens);
+
+    in.readRawData((char*)cache.lineHashes.data(), lines * sizeof(uint));
+    in.readRawData((char*)cache.lineStates.data(), lines * sizeof(uint32_t));
+    in.readRawData((char*)cache.states.data(), states * sizeof(quint64));
+    in.readRawData((char*)cache.lineTokens.data(), (lines + 1) * sizeof(uint32_t));
+    in.readRawData((char*)packed.data(), tokens * sizeof(cached_token_t));
+    if (in.status() != QDataStream::Ok || cache.lineTokens[0] != 0 || cache.lineTokens[lines] != tokens) {
+        return false;
+    }
+    for (size_t i = 0; i < lines; i++) {
+        if (cache.lineTokens[i] > cache.lineTokens[i + 1] || cache.lineStates[i] >= states) {
+            return false;
+        }
+    }
+
+    cache.tokens.resize(tokens);
+    for (size_t i = 0; i < tokens; i++) {
+        cached_token_t& t = packed[i];
+        if (t.scope >= scopes) {
+            return false;
+        }
+        cache.tokens[i] = { .start = t.start, .length = t.length, .scope = (int)t.scope };
+    }
+
+    return true;
+}
+
+bool save_token_cache(const QByteArray& key, token_cache_t& cache)
+{
+    QSaveFile file(token_cache_path(key));
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    quint32 lines = cache.lineHashes.size();
+    quint32 tokens = cache.tokens.size();
+    quint32 scopes = cache.scopeNames.size();
+    quint32 states = cache.states.size();
+
+    QDataStream out(&file);
+    out << (quint32)TOKEN_CACHE_MAGIC << (quint32)TOKEN_CACHE_VERSION;
+    out << cache.grammar << lines << tokens << scopes << states;
+    for (auto& name : cache.scopeNames) {
+        out << QByteArray::fromStdString(name);
+    }
+
+    std::vector<cached_token_t> packed;
+    packed.reserve(tokens);
+    for (auto& t : cache.tokens) {
+        packed.push_back({ (uint32_t)t.start, (uint32_t)t.length, (uint32_t)t.scope });
+    }
+
+    out.writeRawData((const char*)cache.lineHashes.data(), lines * sizeof(uint));
+    out.writeRawData((const char*)cache.lineStates.data(), lines * sizeof(uint32_t));
+    out.writeRawData((const char*)cache.states.data(), states * sizeof(quint64));
+    out.writeRawData((const char*)cache.lineTokens.data(), (lines + 1) * sizeof(uint32_t));
+    out.writeRawData((const char*)packed.data(), tokens * sizeof(cached_token_t));
+
+    if (!file.commit()) {
+        return false;
+    }
+
+    prune_token_cache();
+    return true;
+}
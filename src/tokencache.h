@@ -0,0 +1,37 @@
+#ifndef TOKENCACHE_H
+#define TOKENCACHE_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <string>
+#include <vector>
+
+#include "tokenizer.h"
+
+//----------------------
+// token cache
+//----------------------
+// tokens of large files are kept on disk between sessions, keyed by the
+// file's path and checked against the grammar and per line hashes, lines
+// up to the first changed one are taken. scopes are stored by name so ids
+// need not survive a restart. parser stacks can not be rebuilt from
+// outside the parser, end states are stored as signatures (see
+// state_signature) which let the tokenizer stop at a restored line
+struct token_cache_t {
+    QString grammar;
+    std::vector<uint> lineHashes;
+    std::vector<uint32_t> lineStates; // end state of each line, an index into states
+    std::vector<quint64> states;
+    std::vector<uint32_t> lineTokens; // first token of each line, plus one past the end
+    std::vector<token_t> tokens; // scopes index into scopeNames on disk
+    std::vector<std::string> scopeNames;
+};
+
+// the key of a file's cache
+QByteArray token_cache_key(const QString& path);
+
+bool load_token_cache(const QByteArray& key, token_cache_t& cache);
+bool save_token_cache(const QByteArray& key, token_cache_t& cache);
+
+#endif // TOKENCACHE_H
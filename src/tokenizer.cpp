@@ -0,0 +1,812 @@
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "grammarprofile.h"
+#include "parse.h"
+#include "styles.h"
+#include "tokenizer.h"
+
+// post partial results to the gui thread at least this often (ms)
+#define TOKENIZER_POST_INTERVAL 16
+
+// a job is cut short after this long so that the scheduler can re-prioritize (ms)
+#define TOKENIZER_JOB_BUDGET 48
+
+// cpu share given to hidden editors by default (percent)
+#define TOKENIZER_DEFAULT_CPU_SHARE 50
+
+// background jobs sleep off their share after running this long (ms)
+#define TOKENIZER_BACKGROUND_SLICE 10
+
+// slots in the line memo, a power of two
+#define TOKENIZER_MEMO_SIZE 4096
+
+// lines longer than this are shown as plain text, carrying the state through
+#define TOKENIZER_LINE_LIMIT (256 * 1024)
+
+// a compiled grammar is shared by every editor of its language and every
+// tokenizer thread. parses of one grammar take turns on its own lock,
+// different grammars parse in parallel. a grammar that embeds another
+// runs the other's rules too, so grammars linked by embedding form a set
+// that takes turns on one lock. the gui thread never waits on a lock, a
+// line it can not parse right away is left to the tokenizer threads.
+// locks live as long as the grammars
+struct grammar_lock_t {
+    std::string scope;
+    std::set<std::string> includes;
+    QMutex* lock;
+};
+
+static QMutex grammarLocksMutex;
+static std::unordered_map<const void*, grammar_lock_t> grammarLocks;
+
+// bumped when sets are merged and their grammars move to a new lock
+static QAtomicInt grammarLocksGeneration;
+
+// the old locks of a merged set. parses that took one before the merge
+// are waited out by the first parse under the new lock
+static std::unordered_map<QMutex*, std::vector<QMutex*>> retiredLocks;
+static QAtomicInt retiredCount;
+
+static const void* grammar_root(parse::stack_ptr parser_state)
+{
+    // the bottom of the stack holds the grammar's root rule
+    const void* root = 0;
+    for (parse::stack_ptr s = parser_state; s; s = s->parent) {
+        if (s->rule) {
+            root = &*s->rule;
+        }
+    }
+    return root;
+}
+
+static void collect_includes(Json::Value const& node, std::set<std::string>& scopes)
+{
+    if (node.isArray()) {
+        for (auto& n : node) {
+            collect_includes(n, scopes);
+        }
+        return;
+    }
+    if (!node.isObject()) {
+        return;
+    }
+
+    if (node.isMember("include") && node["include"].isString()) {
+        std::string include = node["include"].asString();
+        if (!include.empty() && include[0] != '#' && include[0] != '$') {
+            scopes.insert(include.substr(0, include.find('#')));
+        }
+    }
+    for (auto& n : node) {
+        collect_includes(n, scopes);
+    }
+}
+
+void register_grammar(parse::grammar_ptr grammar, Json::Value const& json)
+{
+    std::set<std::string> includes;
+    collect_includes(json, includes);
+    std::string scope = json["scopeName"].asString();
+
+    QMutexLocker lock(&grammarLocksMutex);
+    const void* root = grammar_root(grammar->seed());
+    grammar_lock_t& entry = grammarLocks[root];
+    if (!entry.lock) {
+        entry.lock = new QMutex();
+    }
+    entry.scope = scope;
+    entry.includes = includes;
+
+    // the sets of the grammars this one embeds or is embedded by
+    std::set<QMutex*> sets = { entry.lock };
+    for (auto& g : grammarLocks) {
+        if (g.first != root && (includes.count(g.second.scope) || g.second.includes.count(scope))) {
+            sets.insert(g.second.lock);
+        }
+    }
+
+    // are merged into one, under a new lock. the old ones are kept,
+    // a parse may be about to take one
+    if (sets.size() > 1) {
+        QMutex* merged = new QMutex();
+        for (auto& g : grammarLocks) {
+            if (sets.count(g.second.lock)) {
+                g.second.lock = merged;
+            }
+        }
+        std::vector<QMutex*>& retired = retiredLocks[merged];
+        for (auto old : sets) {
+            retired.push_back(old);
+            auto it = retiredLocks.find(old);
+            if (it != retiredLocks.end()) {
+                retired.insert(retired.end(), it->second.begin(), it->second.end());
+                retiredLocks.erase(it);
+            }
+        }
+        retiredCount = retiredLocks.size();
+        grammarLocksGeneration.ref();
+    }
+}
+
+static QMutex* grammar_lock(parse::stack_ptr parser_state, int generation)
+{
+    const void* root = grammar_root(parser_state);
+
+    thread_local const void* lastRoot = 0;
+    thread_local int lastGeneration = 0;
+    thread_local QMutex* lastLock = 0;
+    if (lastLock && root == lastRoot && generation == lastGeneration) {
+        return lastLock;
+    }
+
+    QMutexLocker lock(&grammarLocksMutex);
+    grammar_lock_t& entry = grammarLocks[root];
+    if (!entry.lock) {
+        entry.lock = new QMutex();
+    }
+
+    lastRoot = root;
+    lastGeneration = generation;
+    lastLock = entry.lock;
+    return lastLock;
+}
+
+static bool wait_out_retired(QMutex* lock, bool wait)
+{
+    std::vector<QMutex*> retired;
+    {
+        QMutexLocker locker(&grammarLocksMutex);
+        auto it = retiredLocks.find(lock);
+        if (it == retiredLocks.end()) {
+            return true;
+        }
+        retired = it->second;
+    }
+
+    for (auto old : retired) {
+        if (wait) {
+            old->lock();
+        } else if (!old->tryLock()) {
+            return false;
+        }
+        old->unlock();
+    }
+
+    QMutexLocker locker(&grammarLocksMutex);
+    retiredLocks.erase(lock);
+    retiredCount = retiredLocks.size();
+    return true;
+}
+
+// null when the grammar is busy and not waiting
+static QMutex* lock_grammar(parse::stack_ptr parser_state, bool wait)
+{
+    // a lock taken across a move is dropped and looked up again
+    while (true) {
+        int generation = grammarLocksGeneration.load();
+        QMutex* lock = grammar_lock(parser_state, generation);
+        if (wait) {
+            lock->lock();
+        } else if (!lock->tryLock()) {
+            return NULL;
+        }
+        if (generation == grammarLocksGeneration.load()) {
+            if (!retiredCount.load() || wait_out_retired(lock, wait)) {
+                return lock;
+            }
+            lock->unlock();
+            return NULL;
+        }
+        lock->unlock();
+    }
+}
+
+void utf8_line_t::assign(const QString& text)
+{
+    const ushort* src = text.utf16();
+    size_t n = text.length();
+
+    if (str.size() < n * 3 + 2) {
+        str.resize(n * 3 + 2);
+    }
+    char* dst = &str[0];
+
+    // most lines are plain ascii, copy those 8 QChars at a time
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi16((short)0xff80);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), zero)) != 0xffff) {
+            break;
+        }
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(v, v));
+    }
+#endif
+    for (; i < n && src[i] < 0x80; i++) {
+        dst[i] = src[i];
+    }
+
+    if (i == n) {
+        dst[n] = '\n';
+        dst[n + 1] = 0;
+        length = n + 1;
+        ascii = true;
+        return;
+    }
+
+    // encode the rest, keeping track of where each byte came from
+    ascii = false;
+    if (offsets.size() < n * 3 + 2) {
+        offsets.resize(n * 3 + 2);
+    }
+    for (size_t k = 0; k < i; k++) {
+        offsets[k] = k;
+    }
+
+    size_t o = i;
+    for (; i < n; i++) {
+        uint c = src[i];
+        size_t from = i;
+        if (QChar::isHighSurrogate(c) && i + 1 < n && QChar::isLowSurrogate(src[i + 1])) {
+            c = QChar::surrogateToUcs4(c, src[i + 1]);
+            i++;
+        } else if (QChar::isSurrogate(c)) {
+            c = QChar::ReplacementCharacter;
+        }
+
+        if (c < 0x80) {
+            offsets[o] = from;
+            dst[o++] = c;
+        } else if (c < 0x800) {
+            offsets[o] = offsets[o + 1] = from;
+            dst[o++] = 0xc0 | (c >> 6);
+            dst[o++] = 0x80 | (c & 0x3f);
+        } else if (c < 0x10000) {
+            offsets[o] = offsets[o + 1] = offsets[o + 2] = from;
+            dst[o++] = 0xe0 | (c >> 12);
+            dst[o++] = 0x80 | ((c >> 6) & 0x3f);
+            dst[o++] = 0x80 | (c & 0x3f);
+        } else {
+            offsets[o] = offsets[o + 1] = offsets[o + 2] = offsets[o + 3] = from;
+            dst[o++] = 0xf0 | (c >> 18);
+            dst[o++] = 0x80 | ((c >> 12) & 0x3f);
+            dst[o++] = 0x80 | ((c >> 6) & 0x3f);
+            dst[o++] = 0x80 | (c & 0x3f);
+        }
+    }
+
+    offsets[o] = n;
+    dst[o++] = '\n';
+    offsets[o] = n + 1;
+    dst[o] = 0;
+    length = o;
+}
+
+static bool parse_line(utf8_line_t& line, parse::stack_ptr& parser_state, bool firstLine, std::vector<token_t>& tokens, bool wait)
+{
+    if (!line.length) {
+        tokens.clear();
+        return true;
+    }
+
+    // utf-8 offsets to a token run in QChars
+    auto addToken = [&line, &tokens](size_t start, size_t end, int scope) {
+        size_t s = line.to_utf16(start);
+        tokens.push_back({ .start = s, .length = line.to_utf16(end) - s, .scope = scope });
+    };
+
+    if (line.length > TOKENIZER_LINE_LIMIT) {
+        tokens.clear();
+        addToken(0, line.length, 0);
+        return true;
+    }
+
+    const char* first = line.data();
+    const char* last = first + line.length;
+
+    std::map<size_t, scope::scope_t> scopes;
+
+    GrammarProfile* profile = GrammarProfile::instance();
+    bool profiling = profile->isEnabled();
+    parse::stack_ptr start_state = parser_state;
+
+    QMutex* lock = lock_grammar(parser_state, wait);
+    if (!lock) {
+        return false;
+    }
+
+    // time waiting on the lock is not the grammar's
+    QElapsedTimer timer;
+    if (profiling) {
+        timer.start();
+    }
+    parser_state = parse::parse(first, last, parser_state, scopes, firstLine);
+    lock->unlock();
+    if (profiling) {
+        profile->record(start_state, scopes, timer.nsecsElapsed());
+    }
+
+    tokens.clear();
+    size_t tokenStart = 0;
+    int tokenScope = 0;
+    for (auto& s : scopes) {
+        if (s.first > tokenStart) {
+            addToken(tokenStart, s.first, tokenScope);
+            tokenStart = s.first;
+        }
+        tokenScope = scope_id(s.second);
+    }
+    if (line.length > tokenStart) {
+        addToken(tokenStart, line.length, tokenScope);
+    }
+
+    return true;
+}
+
+parse::stack_ptr tokenize_line(utf8_line_t& line, parse::stack_ptr parser_state, bool firstLine, std::vector<token_t>& tokens)
+{
+    parse_line(line, parser_state, firstLine, tokens, true);
+    return parser_state;
+}
+
+bool try_tokenize_line(utf8_line_t& line, parse::stack_ptr& parser_state, bool firstLine, std::vector<token_t>& tokens)
+{
+    return parse_line(line, parser_state, firstLine, tokens, false);
+}
+
+quint64 state_signature(parse::stack_ptr parser_state)
+{
+    quint64 hash = 0;
+    for (parse::stack_ptr s = parser_state; s; s = s->parent) {
+        hash = hash * 31 + (s->rule ? s->rule->rule_id : 0) + 1;
+    }
+    return hash;
+}
+
+int ParserStatePool::intern(parse::stack_ptr& parser_state)
+{
+    if (!parser_state) {
+        return 0;
+    }
+
+    size_t hash = state_signature(parser_state);
+
+    QMutexLocker lock(&mutex);
+    std::vector<int>& bucket = buckets[hash];
+    for (int id : bucket) {
+        parse::stack_ptr& s = states[id];
+        if (s == parser_state || *s == *parser_state) {
+            parser_state = s;
+            return id + 1;
+        }
+    }
+
+    bucket.push_back(states.size());
+    states.push_back(parser_state);
+    return states.size();
+}
+
+parse::stack_ptr ParserStatePool::state(int id)
+{
+    if (!id) {
+        return NULL;
+    }
+    QMutexLocker lock(&mutex);
+    return states[id - 1];
+}
+
+LineMemo::LineMemo()
+    : entries(TOKENIZER_MEMO_SIZE)
+{
+    for (auto& e : entries) {
+        e.state = -1;
+    }
+}
+
+size_t LineMemo::slot(int state, const QString& text)
+{
+    return (qHash(text) ^ (state * 0x9e3779b1u)) & (TOKENIZER_MEMO_SIZE - 1);
+}
+
+bool LineMemo::lookup(int state, const QString& text, std::vector<token_t>& tokens, int& endState)
+{
+    QMutexLocker lock(&mutex);
+    entry_t& e = entries[slot(state, text)];
+    if (e.state != state || e.text != text) {
+        return false;
+    }
+    tokens = e.tokens;
+    endState = e.endState;
+    return true;
+}
+
+void LineMemo::store(int state, const QString& text, std::vector<token_t>& tokens, int endState)
+{
+    QMutexLocker lock(&mutex);
+    entry_t& e = entries[slot(state, text)];
+    e.state = state;
+    e.endState = endState;
+    e.text = text;
+    e.tokens = tokens;
+}
+
+Tokenizer::Tokenizer(QObject* parent)
+    : QObject(parent)
+    , job(std::make_shared<tokenizer_job_t>())
+{
+    job->owner = this;
+}
+
+Tokenizer::~Tokenizer()
+{
+    // a worker still on the job finishes the line at hand and drops it
+    cancel();
+    job->mutex.lock();
+    job->owner = 0;
+    job->mutex.unlock();
+    TokenizerPool::instance()->remove(job);
+}
+
+void Tokenizer::tokenize(parser_state_pool_ptr pool, line_memo_ptr memo, parse::stack_ptr parser_state, std::vector<line_snapshot_t>& lines)
+{
+    job->mutex.lock();
+    job->generation.ref();
+    job->pool = pool;
+    job->memo = memo;
+    job->state = parser_state;
+    job->lines.swap(lines);
+    job->results.clear();
+    job->hasJob = true;
+    job->jobDone = false;
+    job->mutex.unlock();
+
+    TokenizerPool::instance()->submit(job);
+}
+
+void Tokenizer::cancel()
+{
+    QMutexLocker lock(&job->mutex);
+    job->generation.ref();
+    job->lines.clear();
+    job->results.clear();
+    job->state.reset();
+    job->hasJob = false;
+    job->jobDone = false;
+}
+
+void Tokenizer::setForeground(bool fg)
+{
+    job->foreground = fg ? 1 : 0;
+}
+
+bool Tokenizer::takeResults(std::vector<tokenized_line_t>& lines)
+{
+    QMutexLocker lock(&job->mutex);
+    if (lines.empty()) {
+        lines.swap(job->results);
+    } else {
+        lines.insert(lines.end(), job->results.begin(), job->results.end());
+        job->results.clear();
+    }
+
+    bool done = job->jobDone;
+    job->jobDone = false;
+    return done;
+}
+
+void tokenizer_job_t::post(std::vector<tokenized_line_t>& tokenized, int gen, bool last)
+{
+    if (tokenized.empty() && !last) {
+        return;
+    }
+
+    // the owner is notified under the lock, it can not be going away meanwhile
+    QMutexLocker lock(&mutex);
+    if (gen == generation.load() && owner) {
+        results.insert(results.end(), tokenized.begin(), tokenized.end());
+        jobDone = last;
+        emit owner->tokenized();
+    }
+    tokenized.clear();
+}
+
+void tokenizer_job_t::run(TokenizerPool* threadPool, bool background)
+{
+    mutex.lock();
+    if (!hasJob) {
+        mutex.unlock();
+        return;
+    }
+
+    int gen = generation.load();
+    parser_state_pool_ptr pool = this->pool;
+    line_memo_ptr memo = this->memo;
+    parse::stack_ptr parser_state = state;
+    std::vector<line_snapshot_t> lines;
+    lines.swap(this->lines);
+    state.reset();
+    hasJob = false;
+    mutex.unlock();
+
+    int share = threadPool->cpuShare();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QElapsedTimer jobTimer;
+    jobTimer.start();
+
+    QElapsedTimer sliceTimer;
+    sliceTimer.start();
+
+    int state = pool->intern(parser_state);
+
+    // per thread scratch, grows to the longest line the thread has seen
+    thread_local utf8_line_t utf8;
+    std::vector<tokenized_line_t> tokenized;
+    for (auto& line : lines) {
+        if (gen != generation.load()) {
+            break;
+        }
+
+        tokenized_line_t res;
+        res.number = line.number;
+        res.revision = line.revision;
+
+        bool firstLine = line.number == 0;
+        bool memoize = line.text.length() <= TOKENIZER_LONG_LINE;
+        if (memoize && memo->lookup(firstLine ? 0 : state, line.text, res.tokens, res.state)) {
+            res.parser_state = pool->state(res.state);
+        } else {
+            utf8.assign(line.text);
+
+            // long lines are parsed whole, post what is done before one
+            if (line.text.length() > TOKENIZER_LONG_LINE && tokenized.size()) {
+                post(tokenized, gen, false);
+                timer.restart();
+            }
+
+            res.parser_state = tokenize_line(utf8, parser_state, firstLine, res.tokens);
+            if (gen != generation.load()) {
+                break;
+            }
+
+            res.state = pool->intern(res.parser_state);
+            if (memoize) {
+                memo->store(firstLine ? 0 : state, line.text, res.tokens, res.state);
+            }
+        }
+
+        state = res.state;
+        parser_state = res.parser_state;
+        tokenized.emplace_back(std::move(res));
+
+        // the rest of the lines would come out the same
+        if (parser_state == line.parser_state) {
+            break;
+        }
+        if (line.signature && state_signature(parser_state) == line.signature) {
+            break;
+        }
+
+        if (jobTimer.elapsed() > TOKENIZER_JOB_BUDGET) {
+            break;
+        }
+
+        if (background) {
+            // step aside for the editor in front
+            if (threadPool->foregroundWaiting()) {
+                break;
+            }
+
+            // and keep to our share of the cpu
+            if (share < 100 && sliceTimer.elapsed() >= TOKENIZER_BACKGROUND_SLICE) {
+                post(tokenized, gen, false);
+                qint64 idle = sliceTimer.elapsed() * (100 - share) / share;
+                for (; idle > 0 && gen == generation.load() && !threadPool->foregroundWaiting(); idle -= TOKENIZER_BACKGROUND_SLICE) {
+                    QThread::msleep(std::min(idle, (qint64)TOKENIZER_BACKGROUND_SLICE));
+                }
+                sliceTimer.restart();
+                jobTimer.restart();
+            }
+        }
+
+        if (timer.elapsed() > TOKENIZER_POST_INTERVAL) {
+            post(tokenized, gen, false);
+            timer.restart();
+        }
+    }
+
+    post(tokenized, gen, true);
+}
+
+//----------------------
+// tokenizer pool
+//----------------------
+class TokenizerThread : public QThread {
+public:
+    TokenizerThread(TokenizerPool* pool)
+        : pool(pool)
+    {
+    }
+
+protected:
+    void run() override
+    {
+        pool->work(this);
+    }
+
+private:
+    TokenizerPool* pool;
+};
+
+TokenizerPool* TokenizerPool::instance()
+{
+    static TokenizerPool pool;
+    return &pool;
+}
+
+TokenizerPool::TokenizerPool()
+    : foregroundRunning(0)
+    , maxThreads(1)
+    , share(TOKENIZER_DEFAULT_CPU_SHARE)
+    , quit(false)
+{
+    configure(0, TOKENIZER_DEFAULT_CPU_SHARE);
+}
+
+TokenizerPool::~TokenizerPool()
+{
+    mutex.lock();
+    quit = true;
+    condition.wakeAll();
+    mutex.unlock();
+
+    for (auto thread : threads) {
+        thread->wait();
+        delete thread;
+    }
+}
+
+void TokenizerPool::configure(int threadCount, int cpuShare)
+{
+    QMutexLocker lock(&mutex);
+
+    // 0 picks half the cores, leaving the rest to the gui and the system
+    if (threadCount <= 0) {
+        threadCount = QThread::idealThreadCount() / 2;
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    maxThreads = threadCount;
+
+    if (cpuShare < 1) {
+        cpuShare = 1;
+    }
+    if (cpuShare > 100) {
+        cpuShare = 100;
+    }
+    share = cpuShare;
+
+    condition.wakeAll();
+}
+
+void TokenizerPool::submit(tokenizer_job_ptr job)
+{
+    QMutexLocker lock(&mutex);
+    if (std::find(queue.begin(), queue.end(), job) == queue.end()) {
+        queue.push_back(job);
+    }
+
+    // threads are started as needed, up to the configured count
+    if (threads.size() < maxThreads && threads.size() <= running.size()) {
+        QThread* thread = new TokenizerThread(this);
+        threads.push_back(thread);
+        thread->start(QThread::LowPriority);
+    }
+    condition.wakeOne();
+}
+
+void TokenizerPool::remove(tokenizer_job_ptr job)
+{
+    // a running job is not waited for, it was cancelled and its worker
+    // holds on to it until done
+    QMutexLocker lock(&mutex);
+    auto it = std::find(queue.begin(), queue.end(), job);
+    if (it != queue.end()) {
+        queue.erase(it);
+    }
+}
+
+bool TokenizerPool::isRunning(const tokenizer_job_ptr& job)
+{
+    return std::find(running.begin(), running.end(), job) != running.end();
+}
+
+bool TokenizerPool::foregroundWaiting()
+{
+    QMutexLocker lock(&mutex);
+    if (foregroundRunning > 0) {
+        return true;
+    }
+    for (auto& job : queue) {
+        if (job->isForeground() && !isRunning(job)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+tokenizer_job_ptr TokenizerPool::take()
+{
+    // foreground first, never two threads on the same job. background
+    // jobs wait while a foreground one is running, they would only step
+    // aside again
+    while (!quit) {
+        if (running.size() < maxThreads) {
+            auto pick = queue.end();
+            for (auto it = queue.begin(); it != queue.end(); it++) {
+                if (isRunning(*it)) {
+                    continue;
+                }
+                if ((*it)->isForeground()) {
+                    pick = it;
+                    break;
+                }
+                if (pick == queue.end() && foregroundRunning == 0) {
+                    pick = it;
+                }
+            }
+
+            if (pick != queue.end()) {
+                tokenizer_job_ptr job = *pick;
+                queue.erase(pick);
+                running.push_back(job);
+                return job;
+            }
+        }
+        condition.wait(&mutex);
+    }
+    return NULL;
+}
+
+void TokenizerPool::work(QThread* thread)
+{
+    mutex.lock();
+    while (true) {
+        tokenizer_job_ptr job = take();
+        if (!job) {
+            break;
+        }
+
+        // a job runs as it was taken, foreground or not
+        bool foreground = job->isForeground();
+        if (foreground) {
+            foregroundRunning++;
+        }
+        mutex.unlock();
+
+        thread->setPriority(foreground ? QThread::NormalPriority : QThread::LowestPriority);
+        job->run(this, !foreground);
+
+        mutex.lock();
+        if (foreground) {
+            foregroundRunning--;
+        }
+        running.erase(std::find(running.begin(), running.end(), job));
+        condition.wakeAll();
+    }
+    mutex.unlock();
+}
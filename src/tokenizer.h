@@ -0,0 +1,225 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "grammar.h"
+#include "json/json.h"
+
+struct token_t {
+    size_t start;
+    size_t length;
+    int scope;
+};
+
+struct line_snapshot_t {
+    int number;
+    int revision;
+    QString text;
+    parse::stack_ptr parser_state; // end state currently stored for the line
+    quint64 signature; // end state of a restored line whose stack is not known
+};
+
+struct tokenized_line_t {
+    int number;
+    int revision;
+    int state;
+    parse::stack_ptr parser_state;
+    std::vector<token_t> tokens;
+};
+
+// a hash of the rule ids on a parser stack. two stacks with the same rules
+// are taken to be the same state where the stacks themselves are not known
+quint64 state_signature(parse::stack_ptr parser_state);
+
+// parser states are interned so that comparing two of them is a pointer
+// (or id) compare. ids are stable for the lifetime of the pool
+class ParserStatePool {
+public:
+    int intern(parse::stack_ptr& parser_state);
+    parse::stack_ptr state(int id);
+
+private:
+    QMutex mutex;
+    std::vector<parse::stack_ptr> states;
+    std::unordered_map<size_t, std::vector<int>> buckets;
+};
+
+// a line parsed from a given interned state always comes out the same, so
+// repeated lines (blank ones, closing braces, log prefixes..) skip the
+// parser. direct mapped, keyed by start state id (0 for the first line)
+// and text
+class LineMemo {
+public:
+    LineMemo();
+
+    bool lookup(int state, const QString& text, std::vector<token_t>& tokens, int& endState);
+    void store(int state, const QString& text, std::vector<token_t>& tokens, int endState);
+
+private:
+    struct entry_t {
+        int state;
+        int endState;
+        QString text;
+        std::vector<token_t> tokens;
+    };
+
+    size_t slot(int state, const QString& text);
+
+    QMutex mutex;
+    std::vector<entry_t> entries;
+};
+
+typedef std::shared_ptr<ParserStatePool> parser_state_pool_ptr;
+typedef std::shared_ptr<LineMemo> line_memo_ptr;
+
+// utf-8 copy of a line for the parser (ending with "\n") and a map from
+// its byte offsets back to QChar offsets. meant to be reused line to line
+struct utf8_line_t {
+    std::string str; // only grows, the line is the first length bytes
+    std::vector<int> offsets; // byte -> QChar, unused when ascii
+    size_t length;
+    bool ascii;
+
+    utf8_line_t()
+        : length(0)
+        , ascii(true)
+    {
+    }
+
+    void assign(const QString& text);
+
+    const char* data() { return str.c_str(); }
+    size_t to_utf16(size_t offset) { return ascii ? offset : offsets[offset]; }
+};
+
+// lines longer than this are not parsed on the gui thread
+#define TOKENIZER_LONG_LINE 500
+
+// registers a freshly compiled grammar for parser locking. grammars linked
+// by embedding share a lock
+void register_grammar(parse::grammar_ptr grammar, Json::Value const& json);
+
+// parse a single line and collect its token runs, in QChar offsets. the
+// line goes to the parser whole, there is no safe place to cut it: a cut
+// looks like the end of the line to $, lookaheads and line comments.
+// lines past TOKENIZER_LINE_LIMIT are not highlighted, the state is
+// carried through them unchanged
+parse::stack_ptr tokenize_line(utf8_line_t& line, parse::stack_ptr parser_state, bool firstLine, std::vector<token_t>& tokens);
+
+// same, but false without waiting when another thread is parsing with the
+// grammar. for the gui thread
+bool try_tokenize_line(utf8_line_t& line, parse::stack_ptr& parser_state, bool firstLine, std::vector<token_t>& tokens);
+
+class TokenizerPool;
+class Tokenizer;
+
+// a highlighter's job, shared with the worker running it so that the
+// highlighter can go away without waiting for the worker
+struct tokenizer_job_t {
+    QMutex mutex;
+    QAtomicInt generation;
+    QAtomicInt foreground;
+    Tokenizer* owner; // null once the tokenizer is gone
+
+    bool hasJob;
+    bool jobDone;
+
+    parser_state_pool_ptr pool;
+    line_memo_ptr memo;
+    parse::stack_ptr state;
+    std::vector<line_snapshot_t> lines;
+    std::vector<tokenized_line_t> results;
+
+    tokenizer_job_t()
+        : generation(0)
+        , foreground(1)
+        , owner(0)
+        , hasJob(false)
+        , jobDone(false)
+    {
+    }
+
+    void run(TokenizerPool* pool, bool background);
+    void post(std::vector<tokenized_line_t>& lines, int gen, bool last);
+
+    bool isForeground() { return foreground.load(); }
+};
+
+typedef std::shared_ptr<tokenizer_job_t> tokenizer_job_ptr;
+
+// a highlighter's handle on the tokenizer pool. holds at most one job,
+// a new job or a cancel supersedes whatever is running
+class Tokenizer : public QObject {
+    Q_OBJECT
+
+public:
+    Tokenizer(QObject* parent = 0);
+    ~Tokenizer();
+
+    void tokenize(parser_state_pool_ptr pool, line_memo_ptr memo, parse::stack_ptr parser_state, std::vector<line_snapshot_t>& lines);
+    void cancel();
+    bool takeResults(std::vector<tokenized_line_t>& lines);
+
+    // jobs of the foreground editor run first and at normal priority
+    void setForeground(bool fg);
+    bool isForeground() { return job->isForeground(); }
+
+private:
+    tokenizer_job_ptr job;
+
+signals:
+    void tokenized();
+};
+
+//----------------------
+// tokenizer pool
+//----------------------
+// worker threads shared by all editors. background (hidden tab) jobs get
+// a share of the cpu, and step aside while a foreground job is queued or
+// running
+class TokenizerPool {
+public:
+    static TokenizerPool* instance();
+
+    TokenizerPool();
+    ~TokenizerPool();
+
+    void configure(int threads, int cpuShare);
+
+    void submit(tokenizer_job_ptr job);
+    void remove(tokenizer_job_ptr job);
+
+    bool foregroundWaiting();
+    int cpuShare() { return share; }
+
+    void work(QThread* thread);
+
+private:
+    tokenizer_job_ptr take();
+    bool isRunning(const tokenizer_job_ptr& job);
+
+    QMutex mutex;
+    QWaitCondition condition;
+
+    std::deque<tokenizer_job_ptr> queue;
+    std::vector<tokenizer_job_ptr> running;
+    std::vector<QThread*> threads;
+
+    int foregroundRunning;
+    int maxThreads;
+    int share;
+    bool quit;
+};
+
+#endif // TOKENIZER_H